@@ -11,18 +11,19 @@ import android.content.BroadcastReceiver;
 import android.content.Context;
 import android.content.Intent;
 import android.content.IntentFilter;
+import android.os.SystemClock;
 import android.support.annotation.NonNull;
 import android.util.Log;
 
-import java.io.UnsupportedEncodingException;
 import java.nio.BufferUnderflowException;
 import java.nio.ByteBuffer;
 import java.nio.ByteOrder;
-import java.nio.charset.Charset;
+import java.nio.charset.StandardCharsets;
 import java.util.ArrayList;
 import java.util.Collections;
 import java.util.LinkedList;
 import java.util.List;
+import java.util.Locale;
 import java.util.Queue;
 import java.util.UUID;
 
@@ -38,8 +39,11 @@ public final class BLEBadge {
     private BLEBadgeUpdateNotifier mNotifier = null;
     private int mPendingCharacteristics = 0;
     private GattQueue mQueue = null;
+    private long mConnectedAt = 0;
+    private long mConfigStartedAt = 0;
 
     // Data from the badge itself
+    private String mName = null;
     private boolean mDisplayEnabled = false;
     private byte mBrightness = 0;
     private byte mCurrentMessage = 0;
@@ -56,7 +60,8 @@ public final class BLEBadge {
 
     // Get the name of the device.
     public String getName() {
-        return mDevice.getName();
+        // The device name is only refreshed by a scan
+        return (mName != null) ? mName : mDevice.getName();
     }
 
     // Change the name of the device
@@ -71,6 +76,7 @@ public final class BLEBadge {
                 Constants.DeviceNameUUID);
         nameChar.setValue(newName);
         mQueue.add(GattQueueOperation.Write(nameChar));
+        mName = newName;
     }
 
     // Get the address of the device.
@@ -160,6 +166,68 @@ public final class BLEBadge {
         }
     }
 
+    // Write the name, display state and all the messages as one config bundle, which the badge
+    // applies and saves all at once.  Returns false if the badge's firmware predates bundles.
+    public boolean saveConfig() throws BLEBadgeException {
+        if (mBadgeService == null || mQueue == null || !connected())
+            return false;
+        BluetoothGattCharacteristic configChar = mBadgeService.getCharacteristic(
+                Constants.ConfigUUID);
+        if (configChar == null)
+            return false;
+        byte[] bundle;
+        synchronized (mMessages) {
+            bundle = packConfig(getName(), mMessages);
+        }
+        configChar.setValue(bundle);
+        mConfigStartedAt = SystemClock.elapsedRealtime();
+        mQueue.add(GattQueueOperation.Write(configChar));
+        return true;
+    }
+
+    // Must match badge_config_t in the firmware
+    private byte[] packConfig(String name, List<BLEBadgeMessage> messages)
+            throws BLEBadgeException {
+        if (messages.size() != Constants.NumMessages)
+            throw new BLEBadgeException("Not all messages have been read.");
+        byte[] nameBytes = (name == null) ? new byte[0] : name.getBytes(StandardCharsets.US_ASCII);
+        if (nameBytes.length == 0 || nameBytes.length >= Constants.ConfigNameLength)
+            throw new BLEBadgeException("Name must be 1 to " +
+                    (Constants.ConfigNameLength - 1) + " characters.");
+        ByteBuffer buffer = ByteBuffer.allocate(Constants.ConfigSize);
+        buffer.order(ByteOrder.LITTLE_ENDIAN);
+        buffer.put((byte)Constants.ConfigVersion);
+        buffer.put((byte)0);
+        buffer.putShort((short)0);  // CRC, filled in below
+        buffer.put(nameBytes);
+        buffer.position(4 + Constants.ConfigNameLength);
+        buffer.put(mBrightness);
+        buffer.put((byte)(mDisplayEnabled ? 1 : 0));
+        buffer.put(mCurrentMessage);
+        buffer.put((byte)0);
+        for (BLEBadgeMessage msg : messages) {
+            int start = buffer.position();
+            buffer.put(msg.toBytes());
+            buffer.position(start + Constants.MessageSize);
+        }
+        byte[] bundle = buffer.array();
+        buffer.putShort(2, crc16(bundle, 4, bundle.length - 4));
+        return bundle;
+    }
+
+    // crc16_compute() from the nRF SDK: CCITT, initial value 0xFFFF
+    private static short crc16(byte[] data, int offset, int length) {
+        int crc = 0xFFFF;
+        for (int i = offset; i < offset + length; i++) {
+            crc = ((crc >> 8) | (crc << 8)) & 0xFFFF;
+            crc ^= data[i] & 0xFF;
+            crc ^= (crc & 0xFF) >> 4;
+            crc ^= (crc << 12) & 0xFFFF;
+            crc ^= ((crc & 0xFF) << 5) & 0xFFFF;
+        }
+        return (short)crc;
+    }
+
     // Connect to remote
     // Returns true if connected or connecting, false if not yet bonded
     public boolean connect() {
@@ -261,6 +329,15 @@ public final class BLEBadge {
             return;
         }
         List<BluetoothGattCharacteristic> chars = mBadgeService.getCharacteristics();
+        // A failed read would stall the queue.  The DB hash is only there for the badge to tell
+        // bonded phones' Bluetooth stacks when to drop their cached attribute table.
+        List<BluetoothGattCharacteristic> readable = new ArrayList<>();
+        for(BluetoothGattCharacteristic item : chars) {
+            if ((item.getProperties() & BluetoothGattCharacteristic.PROPERTY_READ) != 0 &&
+                    !item.getUuid().equals(Constants.DbHashUUID))
+                readable.add(item);
+        }
+        chars = readable;
         synchronized (this) {
             mPendingCharacteristics = chars.size();
         }
@@ -327,6 +404,12 @@ public final class BLEBadge {
             mMessageChars.addAll(characteristics);
         }
 
+        if (mConnectedAt != 0) {
+            Log.i(TAG, "Ready " + (SystemClock.elapsedRealtime() - mConnectedAt) +
+                    " ms after connecting.");
+            mConnectedAt = 0;
+        }
+
         // Finally notify that state has changed
         notifyChanged();
     }
@@ -336,12 +419,14 @@ public final class BLEBadge {
 
         private MessageMode mMode;
         private MessageSpeed mRate;
+        private byte mBlink;
         private String mText;
         private boolean changed = false;
 
-        private BLEBadgeMessage(MessageMode mode, MessageSpeed rate, String text) {
+        private BLEBadgeMessage(MessageMode mode, MessageSpeed rate, byte blink, String text) {
             mMode = mode;
             mRate = rate;
+            mBlink = blink;
             mText = text;
         }
 
@@ -378,16 +463,51 @@ public final class BLEBadge {
                     throw new BLEBadgeException("Unknown message rate!");
                 }
             }
-            int offset = readBuffer.position();
-            int length = value.length - offset;
-            for(int i = offset; i < value.length; i ++) {
-                if (value[i] == (byte)0) {
-                    length = i - offset;
+            byte blink;
+            int length;
+            try {
+                blink = readBuffer.get();
+                length = readBuffer.get() & 0xFF;
+            } catch (BufferUnderflowException ex) {
+                Log.e(TAG, "Buffer underflow!", ex);
+                throw new BLEBadgeException("Characteristic too short!");
+            }
+            String text = unpackText(value, readBuffer.position(), length);
+            return new BLEBadgeMessage(mode, rate, blink, text);
+        }
+
+        // Text is packed 6 bits a character, first character in the low bits.  Codes 0-63 are
+        // ASCII 0x20-0x5F; must match message_set_text() in the firmware.
+        private static byte[] packText(String text) {
+            int length = Math.min(text.length(), Constants.MessageMaxLength);
+            byte[] packed = new byte[(length * 6 + 7) / 8];
+            for (int i = 0; i < length; i++) {
+                int c = text.charAt(i);
+                if (c >= 0x60 && c < 0x80)
+                    c -= 0x20;
+                if (c < 0x20 || c >= 0x60)
+                    c = ' ';
+                int code = (c - 0x20) << ((i * 6) % 8);
+                packed[(i * 6) / 8] |= (byte)code;
+                if ((code >> 8) != 0)
+                    packed[(i * 6) / 8 + 1] |= (byte)(code >> 8);
+            }
+            return packed;
+        }
+
+        private static String unpackText(byte[] value, int offset, int length) {
+            StringBuilder text = new StringBuilder();
+            length = Math.min(length, Constants.MessageMaxLength);
+            for (int i = 0; i < length; i++) {
+                int pos = offset + (i * 6) / 8;
+                if (pos >= value.length)
                     break;
-                }
+                int word = value[pos] & 0xFF;
+                if (pos + 1 < value.length)
+                    word |= (value[pos + 1] & 0xFF) << 8;
+                text.append((char)(((word >> ((i * 6) % 8)) & 0x3F) + 0x20));
             }
-            String text = new String(value, offset, length, Charset.forName("US-ASCII"));
-            return new BLEBadgeMessage(mode, rate, text);
+            return text.toString();
         }
 
         public void updateCharacteristic(BluetoothGattCharacteristic characteristic) {
@@ -404,6 +524,8 @@ public final class BLEBadge {
                 throw new BLEBadgeException(
                         "Message is limited to " + Constants.MessageMaxLength + " characters.");
             }
+            // The badge only has uppercase
+            text = text.toUpperCase(Locale.US);
             if (text.equals(mText))
                 return;
             mText = text;
@@ -436,22 +558,18 @@ public final class BLEBadge {
             return changed;
         }
 
-        private byte[] toBytes() {
-            final byte[] messageBytes;
-            try {
-                messageBytes = mText.getBytes("US-ASCII");
-            } catch(UnsupportedEncodingException ex) {
-                Log.e(TAG, "Unsupported encoding in toBytes!", ex);
-                return null;
-            }
-            int length = MessageMode.SIZE + MessageSpeed.SIZE + messageBytes.length + 1;
+        byte[] toBytes() {
+            final byte[] packedText = packText(mText);
+            // Only as much of the characteristic as the text needs
+            int length = MessageMode.SIZE + MessageSpeed.SIZE + 2 + packedText.length;
             byte[] rawBuffer = new byte[length];
             ByteBuffer buffer = ByteBuffer.wrap(rawBuffer);
             buffer.order(ByteOrder.LITTLE_ENDIAN);
             buffer.put(mMode.encode());
             buffer.putShort(mRate.encode());
-            buffer.put(messageBytes);
-            buffer.put((byte)0); // ensure null termination on the firmware side
+            buffer.put(mBlink);
+            buffer.put((byte)Math.min(mText.length(), Constants.MessageMaxLength));
+            buffer.put(packedText);
             return buffer.array();
         }
     }
@@ -497,6 +615,9 @@ public final class BLEBadge {
             super.onConnectionStateChange(gatt, status, newState);
             Log.d(TAG, "GATT State changed to " + bluetoothGattStateString(newState));
             if (newState == BluetoothGatt.STATE_CONNECTED) {
+                mConnectedAt = SystemClock.elapsedRealtime();
+                // For a bonded badge Android answers this from its cache, which the badge's
+                // Service Changed indication invalidates whenever the attribute table changes
                 if (!gatt.discoverServices()) {
                     Log.e(TAG, "Error requesting service discovery.");
                 }
@@ -552,6 +673,13 @@ public final class BLEBadge {
                 int idx = mMessageChars.indexOf(characteristic);
                 if (idx > -1) {
                     mMessages.get(idx).changed = false;
+                } else if (characteristic.getUuid().equals(Constants.ConfigUUID)) {
+                    synchronized (mMessages) {
+                        for (BLEBadgeMessage msg : mMessages)
+                            msg.changed = false;
+                    }
+                    Log.i(TAG, "Config bundle written in " +
+                            (SystemClock.elapsedRealtime() - mConfigStartedAt) + " ms.");
                 }
             }
         }
@@ -224,8 +224,15 @@ public class BadgeSetupActivity extends AppCompatActivity
     private View.OnClickListener mSaveListener = new View.OnClickListener() {
         @Override
         public void onClick(View v) {
-            mBadge.saveMessages();
             Log.i(TAG, "Save clicked.");
+            try {
+                // Everything in one write where the firmware supports it
+                if (mBadge.saveConfig())
+                    return;
+            } catch (BLEBadge.BLEBadgeException ex) {
+                Log.e(TAG, "Unable to build config bundle.", ex);
+            }
+            mBadge.saveMessages();
         }
     };
 
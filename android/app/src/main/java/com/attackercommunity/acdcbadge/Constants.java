@@ -8,12 +8,19 @@ public final class Constants {
     public static final UUID BadgeIndexUUID = UUID.fromString("00004343-e87e-4706-acf7-8c633c19c4d5");
     public static final UUID DisplayBrightnessUUID = UUID.fromString("00004444-e87e-4706-acf7-8c633c19c4d5");
     public static final UUID MessageUUID = UUID.fromString("00004545-e87e-4706-acf7-8c633c19c4d5");
+    public static final UUID DbHashUUID = UUID.fromString("00004747-e87e-4706-acf7-8c633c19c4d5");
+    public static final UUID ConfigUUID = UUID.fromString("00004848-e87e-4706-acf7-8c633c19c4d5");
     public static final UUID GenericAccessServiceUUID = UUID.fromString("00001800-0000-1000-8000-00805F9B34FB");
     public static final UUID DeviceNameUUID = UUID.fromString("00002A00-0000-1000-8000-00805F9B34FB");
     public static final long ScanDelayMillis = 1000;  // Time to batch up results
     public static final long ScanTimeMillis = 15000;  // Total time before stopping scan
     public static final String BLEDevMessage = "com.attackercommunity.acdcbadge.BLE_DEVICE";
-    public static final int MessageMaxLength = 35; // Must be kept in sync with firmware!
+    public static final int MessageMaxLength = 46; // Must be kept in sync with firmware!
+    public static final int NumMessages = 4;  // Must be kept in sync with firmware!
+    public static final int MessageSize = 40;  // sizeof(led_message) in the firmware
+    public static final int ConfigVersion = 1;  // badge_config_t in the firmware
+    public static final int ConfigSize = 200;
+    public static final int ConfigNameLength = 32;  // Including the NUL
     public static final int MaxBrightness = 15;  // Maximum screen brightness
     public static final boolean PermitUnknownRates = true; // Permit unknown rates coming from firmware
 }
@@ -0,0 +1,105 @@
+/**
+ * Advertising and scan response payloads, kept encoded and double buffered
+ * so they can change while advertising without stopping it.
+ *
+ * ble_advdata_encode() always puts the name last, so everything ahead of it
+ * is encoded once and a new name only rewrites the tail.  The advertising
+ * packet gets as much of the name as fits; the scan response has it all.
+ */
+
+#include <string.h>
+
+#include "nrf_log.h"
+
+#include "adv_data.h"
+#include "trace.h"
+
+typedef struct {
+  uint8_t adv[BLE_GAP_ADV_SET_DATA_SIZE_MAX];
+  uint8_t scan_rsp[BLE_GAP_ADV_SET_DATA_SIZE_MAX];
+} adv_buffers_t;
+
+static uint16_t name_encode(uint8_t *dest, uint16_t max_len, const char *name);
+
+static ble_advertising_t *advertising = NULL;
+static adv_buffers_t buffers[2];
+// The set handed to the SoftDevice last
+static uint8_t live = 0;
+// Advertising packet up to the name
+static uint16_t adv_prefix_len = 0;
+
+/**
+ * Encode everything but the name and hand our buffers to the advertising
+ * module.  Call after ble_advertising_init() and before advertising starts.
+ */
+ret_code_t adv_data_init(ble_advertising_t *adv,
+    const ble_advdata_t *advdata, const char *name) {
+  ble_advdata_t fixed = *advdata;
+  fixed.name_type = BLE_ADVDATA_NO_NAME;
+  adv_prefix_len = sizeof(buffers[0].adv);
+  ret_code_t rv = ble_advdata_encode(
+      &fixed, buffers[0].adv, &adv_prefix_len);
+  if (rv != NRF_SUCCESS)
+    return rv;
+  memcpy(buffers[1].adv, buffers[0].adv, adv_prefix_len);
+  advertising = adv;
+  return adv_data_set_name(name);
+}
+
+/**
+ * Put a new name in the payloads.  The buffers the SoftDevice isn't using
+ * are rewritten and then swapped in, so advertising carries on throughout.
+ */
+ret_code_t adv_data_set_name(const char *name) {
+  if (advertising == NULL)
+    return NRF_ERROR_INVALID_STATE;
+  uint8_t next = !live;
+  adv_buffers_t *buf = &buffers[next];
+  ble_gap_adv_data_t data = {
+    .adv_data = {
+      .p_data = buf->adv,
+      .len = adv_prefix_len + name_encode(buf->adv + adv_prefix_len,
+          sizeof(buf->adv) - adv_prefix_len, name),
+    },
+    .scan_rsp_data = {
+      .p_data = buf->scan_rsp,
+      .len = name_encode(buf->scan_rsp, sizeof(buf->scan_rsp), name),
+    },
+  };
+  // SDK 15.0's ble_advertising_advdata_update() re-encodes a whole
+  // ble_advdata_t into the module's own buffers, so the SoftDevice gets
+  // ours directly.  Before the first start there's no set to update yet.
+  ret_code_t rv = NRF_SUCCESS;
+  if (advertising->adv_handle != BLE_GAP_ADV_SET_HANDLE_NOT_SET)
+    rv = sd_ble_gap_adv_set_configure(&advertising->adv_handle, &data, NULL);
+  if (rv != NRF_SUCCESS) {
+    // The SoftDevice may still be using the live set, leave it be
+    NRF_LOG_WARNING("Advertising data update failed: %d", rv);
+    return rv;
+  }
+  // ble_advertising_start() configures the set from this every time
+  advertising->adv_data = data;
+  live = next;
+  TRACE("Advertising data now %d+%d bytes",
+      data.adv_data.len, data.scan_rsp_data.len);
+  return NRF_SUCCESS;
+}
+
+/**
+ * Write name as an AD structure, shortened if it doesn't fit.  Returns the
+ * bytes used.
+ */
+static uint16_t name_encode(uint8_t *dest, uint16_t max_len, const char *name) {
+  uint16_t len = strlen(name);
+  uint8_t type = BLE_GAP_AD_TYPE_COMPLETE_LOCAL_NAME;
+  if (max_len <= AD_HEADER_LEN)
+    return 0;
+  if (len > max_len - AD_HEADER_LEN) {
+    len = max_len - AD_HEADER_LEN;
+    type = BLE_GAP_AD_TYPE_SHORT_LOCAL_NAME;
+  }
+  dest[0] = len + 1;
+  dest[1] = type;
+  memcpy(dest + AD_HEADER_LEN, name, len);
+  return len + AD_HEADER_LEN;
+}
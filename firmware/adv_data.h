@@ -0,0 +1,15 @@
+#ifndef _ADV_DATA_H_
+#define _ADV_DATA_H_
+
+#include "ble_advdata.h"
+#include "ble_advertising.h"
+#include "sdk_errors.h"
+
+// An AD structure's length and type bytes
+#define AD_HEADER_LEN 2
+
+ret_code_t adv_data_init(ble_advertising_t *adv,
+    const ble_advdata_t *advdata, const char *name);
+ret_code_t adv_data_set_name(const char *name);
+
+#endif /* _ADV_DATA_H_ */
@@ -0,0 +1,103 @@
+/**
+ * Config bundle: name, messages, brightness, on/off and index in one write.
+ *
+ * Once a bundle checks out it's applied in one go from the main loop.  The
+ * bundle itself isn't kept: the per-item records stay the only copy in
+ * flash, and only the items that actually changed are rewritten, so a
+ * bundle never costs more wear than setting the same things one by one.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "app_error.h"
+#include "crc16.h"
+#include "nrf_log.h"
+
+#include "badge_config.h"
+#include "ble_manager.h"
+#include "lanes.h"
+#include "storage.h"
+#include "trace.h"
+
+static void config_apply(void *unused);
+static void config_retry(void *context);
+static bool config_valid(const badge_config_t *bundle);
+static void config_unpack(const badge_config_t *bundle);
+
+APP_TIMER_DEF(config_tmr);
+static led_display *display = NULL;
+badge_config_t config_staging = {0};
+// Checked copy, so a write landing while it's applied can't tear it
+static badge_config_t config;
+
+void badge_config_init(led_display *disp) {
+  display = disp;
+  APP_ERROR_CHECK(app_timer_create(
+        &config_tmr,
+        APP_TIMER_MODE_SINGLE_SHOT,
+        config_retry));
+}
+
+/**
+ * A write to config_staging has completed.  Safe from interrupts.  If
+ * LANE_LOW is full, config_tmr posts it again.
+ */
+void badge_config_post(void) {
+  if (lane_put(LANE_LOW, config_apply, NULL) == NRF_SUCCESS)
+    return;
+  app_timer_stop(config_tmr);
+  APP_ERROR_CHECK(app_timer_start(config_tmr, BADGE_CONFIG_RETRY, NULL));
+}
+
+/**
+ * Check and apply config_staging.  The message table being swapped out may
+ * still be being written from, so this waits for flash to go idle first.
+ */
+static void config_apply(void *unused) {
+  if (storage_is_busy()) {
+    app_timer_stop(config_tmr);
+    APP_ERROR_CHECK(app_timer_start(config_tmr, BADGE_CONFIG_RETRY, NULL));
+    return;
+  }
+  uint32_t start = app_timer_cnt_get();
+  memcpy(&config, &config_staging, sizeof(config));
+  if (!config_valid(&config)) {
+    NRF_LOG_WARNING("Ignoring bad config bundle.");
+    return;
+  }
+  config_unpack(&config);
+  TRACE("Config bundle applied in %d ticks",
+      app_timer_cnt_diff_compute(app_timer_cnt_get(), start));
+}
+
+static void config_retry(void *context) {
+  badge_config_post();
+}
+
+static bool config_valid(const badge_config_t *bundle) {
+  if (bundle->version != BADGE_CONFIG_VERSION)
+    return false;
+  const size_t body = offsetof(badge_config_t, name);
+  if (crc16_compute((const uint8_t *)bundle + body,
+        sizeof(*bundle) - body, NULL) != bundle->crc)
+    return false;
+  if (!bundle->name[0] ||
+      !memchr(bundle->name, '\0', sizeof(bundle->name)))
+    return false;
+  return bundle->state.brightness <= MAX_BRIGHTNESS &&
+    bundle->state.msg_idx >= 0 && bundle->state.msg_idx < NUM_MESSAGES;
+}
+
+/**
+ * Apply a checked bundle and queue saves for whatever changed.
+ */
+static void config_unpack(const badge_config_t *bundle) {
+  ret_code_t rv = display_apply_config(
+      display, bundle->messages, &bundle->state);
+  if (rv != NRF_SUCCESS)
+    NRF_LOG_WARNING("Saving bundle display config failed: %d", rv);
+  rv = ble_manager_set_device_name(bundle->name);
+  if (rv != NRF_SUCCESS)
+    NRF_LOG_WARNING("Saving bundle name failed: %d", rv);
+}
@@ -0,0 +1,38 @@
+#ifndef _BADGE_CONFIG_H_
+#define _BADGE_CONFIG_H_
+
+#include <stdint.h>
+
+#include "app_timer.h"
+
+#include "led_display.h"
+
+#define BADGE_CONFIG_VERSION    1
+#define BADGE_CONFIG_NAME_LEN   32
+// How long to wait for flash, or room on LANE_LOW, before trying a bundle again
+#define BADGE_CONFIG_RETRY      APP_TIMER_TICKS(20)
+
+// Everything the app sets up on a badge, written to the config
+// characteristic in one go.  Little endian; crc is CRC16-CCITT (initial
+// 0xFFFF) over everything after it.
+typedef struct {
+  uint8_t version;
+  uint8_t reserved;
+  uint16_t crc;
+  // NUL terminated
+  char name[BADGE_CONFIG_NAME_LEN];
+  display_state_t state;
+  led_message messages[NUM_MESSAGES];
+} __attribute__ ((packed, aligned(4))) badge_config_t;
+
+// The app packs this by hand
+STATIC_ASSERT(sizeof(badge_config_t) == 200,
+    "badge_config_t layout changed, bump BADGE_CONFIG_VERSION");
+
+// Written over BLE, checked and applied by badge_config_post()
+extern badge_config_t config_staging;
+
+void badge_config_init(led_display *disp);
+void badge_config_post(void);
+
+#endif /* _BADGE_CONFIG_H_ */
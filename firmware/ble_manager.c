@@ -1,19 +1,25 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "adv_data.h"
+#include "badge_config.h"
 #include "ble_manager.h"
+#include "ble_throughput.h"
 #include "led_display.h"
 #include "buttons.h"
+#include "power.h"
 #include "storage.h"
 
 #include "app_error.h"
-#include "app_scheduler.h"
+#include "app_timer.h"
 #include "ble.h"
 #include "ble_advdata.h"
 #include "ble_advertising.h"
 #include "ble_conn_params.h"
 #include "ble_lesc.h"
+#include "ble_radio_notification.h"
 #include "ble_srv_common.h"
+#include "crc32.h"
 #include "fds.h"
 #include "nordic_common.h"
 #include "nrf.h"
@@ -25,12 +31,11 @@
 #include "nrf_sdh_ble.h"
 #include "nrf_sdh_soc.h"
 #include "peer_manager.h"
+#include "selftest.h"
+#include "trace.h"
 
-#if DEBUG_BLE
-# define EVT_DEBUG NRF_LOG_INFO
-#else
-# define EVT_DEBUG(...)
-#endif
+// Cheap enough to leave on everywhere
+#define EVT_DEBUG TRACE
 
 #define MASK_CHANNEL(ch_mask, ch) \
   do { \
@@ -40,75 +45,213 @@
 
 
 NRF_BLE_GATT_DEF(m_gatt);
-NRF_BLE_QWR_DEF(m_qwr);
+NRF_BLE_QWRS_DEF(m_qwr, BLE_MAX_LINKS);
 BLE_ADVERTISING_DEF(m_advertising);
 
 static void ble_advertising_setup();
+static void ble_advertising_resume();
+static void adv_background_start(ble_adv_tier_t tier);
+static ret_code_t adv_restrict_to_37();
+static ble_adv_tier_t adv_policy_tier();
+static void adv_policy_check(void *context);
+static int link_index(uint16_t conn_handle);
+static int link_count();
 static void ble_setup_badge_service(led_display *disp);
 static void ble_error_handler(uint32_t nrf_error);
+static void radio_notification_handler(bool radio_active);
 static void ble_badge_on_ble_evt(ble_evt_t const *p_ble_evt, void *p_context);
 static uint32_t ble_badge_add_onoff_characteristic();
 static uint32_t ble_badge_add_brightness_characteristic();
 static uint32_t ble_badge_add_index_characteristic();
 static uint32_t ble_badge_add_message_characteristics();
 static uint32_t ble_badge_add_message_characteristic(led_message *msg, uint16_t idx);
-static void ble_badge_handle_onoff_write(uint8_t val);
-static void ble_badge_handle_brightness_write(uint8_t val);
-static void ble_badge_handle_index_write(int8_t val);
+static uint32_t ble_badge_add_selftest_characteristic();
+static uint32_t ble_badge_add_db_hash_characteristic();
+static uint32_t ble_badge_add_config_characteristic();
+static void db_hash_compute();
+static void db_hash_check();
+static void ble_badge_on_authorize(uint16_t conn_handle,
+    ble_gatts_evt_rw_authorize_request_t const *req);
+static void ble_badge_value_set(uint16_t handle, uint8_t val);
+static void ble_badge_display_changed(led_display *disp);
 static void conn_params_init();
+static void device_name_apply();
 static void gap_params_init();
 static void advertising_init();
 static void peer_manager_init();
+static bool ble_badge_is_message_handle(uint16_t handle);
+static void gatt_evt_handler(nrf_ble_gatt_t *p_gatt, nrf_ble_gatt_evt_t const *p_evt);
 static void qwr_init();
 static uint16_t qwr_evt_handler(struct nrf_ble_qwr_t *p_qwr, nrf_ble_qwr_evt_t *p_evt);
-static void app_save_messages(void *unused_ptr, uint16_t unused_size);
+static void ble_display_post(display_cmd_type_t type);
 
 char *ble_evt_decode(uint16_t code);
 
-static uint16_t m_conn_handle = BLE_CONN_HANDLE_INVALID;
+static ble_lesc_stats_t lesc_stats = {0};
+// Set from the DHKEY_REQUEST event, cleared once ble_main() has computed it
+static volatile bool lesc_pending = false;
+static volatile uint32_t lesc_requested_at;
+static volatile uint32_t pairing_started_at;
+static volatile bool pairing_used_lesc = false;
+// Value-less display commands that found the queue full, one bit per type.
+// ble_main() posts them again.
+static volatile uint32_t display_retry = 0;
+
+// Connected centrals; a link's slot also picks its m_qwr instance
+static uint16_t m_links[BLE_MAX_LINKS] = {
+  [0 ... BLE_MAX_LINKS-1] = BLE_CONN_HANDLE_INVALID,
+};
+// The link whose passkey is on the display.  Only one at a time.
 static uint16_t m_pending_conn_handle = BLE_CONN_HANDLE_INVALID;
+// The SoftDevice stops advertising on connect, which the advertising module
+// doesn't track
+static bool m_adv_running = false;
+// What we're advertising for, or were when the last central connected
+static ble_adv_tier_t m_adv_tier = ADV_TIER_PAIRING;
+static ble_adv_modes_config_t m_adv_modes;
+APP_TIMER_DEF(adv_policy_tmr);
 static ble_uuid_t m_adv_uuids[1] = {0};
 
 static char device_name[32] __attribute__ ((aligned(4))) = DEVICE_NAME;
 static ble_badge_service_t ble_badge_svc = {0};
+// CRC32 over the handles and UUIDs in the attribute table
+static uint32_t db_hash = 0;
 
 void ble_stack_init(led_display *disp) {
   APP_ERROR_CHECK(nrf_sdh_enable_request());
   uint32_t ram_start = 0;
   APP_ERROR_CHECK(nrf_sdh_ble_default_cfg_set(APP_BLE_CONN_CFG_TAG, &ram_start));
+  uint32_t ram_linked = ram_start;
   APP_ERROR_CHECK(nrf_sdh_ble_enable(&ram_start));
+  // The SoftDevice hands back the lowest start it can live with; that's the
+  // figure nrf52.ld's RAM origin should be set to
+  NRF_LOG_INFO("App RAM starts at 0x%08x, SoftDevice needs 0x%08x.",
+      ram_linked, ram_start);
   NRF_LOG_INFO("SDH started, setting BLE params.");
 
-  int device_name_len = sizeof(device_name);
-  get_device_name(device_name, &device_name_len);
-  device_name[sizeof(device_name)-1] = '\0';
-
+  // The stored device name is patched in by ble_manager_load_storage() once
+  // FDS is ready, so advertising does not have to wait for flash.
   gap_params_init();
   conn_params_init();
   qwr_init();
   peer_manager_init();
   ble_setup_badge_service(disp);
+  // Everything's been added to the table by now
+  db_hash_compute();
   advertising_init();
 
-  APP_ERROR_CHECK(nrf_ble_gatt_init(&m_gatt, NULL));
+  APP_ERROR_CHECK(nrf_ble_gatt_init(&m_gatt, gatt_evt_handler));
+  APP_ERROR_CHECK(ble_radio_notification_init(
+        APP_IRQ_PRIORITY_LOW,
+        RADIO_NOTIFICATION_DISTANCE,
+        radio_notification_handler));
   nrf_gpio_cfg_output(ADV_LED_PIN);
   nrf_gpio_pin_set(ADV_LED_PIN); // we use low, so this is "off"
 
+  APP_ERROR_CHECK(app_timer_create(
+        &adv_policy_tmr,
+        APP_TIMER_MODE_REPEATED,
+        adv_policy_check));
+  APP_ERROR_CHECK(app_timer_start(adv_policy_tmr, ADV_POLICY_INTERVAL, NULL));
+
   //TODO: Add device information service
   ble_manager_start_advertising();
 }
 
+/**
+ * Pick up the device name from flash.  Called once storage is ready, which
+ * may be after advertising has already started.
+ */
+void ble_manager_load_storage(void) {
+  db_hash_check();
+
+  int device_name_len = sizeof(device_name);
+  if (get_device_name(device_name, &device_name_len) != NRF_SUCCESS)
+    return;
+  device_name[sizeof(device_name)-1] = '\0';
+  NRF_LOG_INFO("Loaded device name: %s", nrf_log_push(device_name));
+  device_name_apply();
+  adv_data_set_name(device_name);
+}
+
+/**
+ * Rename the badge, e.g. from a config bundle.  The save is queued before
+ * returning.
+ */
+ret_code_t ble_manager_set_device_name(const char *name) {
+  if (!strncmp(name, device_name, sizeof(device_name)))
+    return NRF_SUCCESS;
+  strncpy(device_name, name, sizeof(device_name)-1);
+  device_name[sizeof(device_name)-1] = '\0';
+  NRF_LOG_INFO("New device name: %s", nrf_log_push(device_name));
+  device_name_apply();
+  adv_data_set_name(device_name);
+  return save_device_name(device_name, strlen(device_name)+1);
+}
+
+/**
+ * Post any display commands that didn't fit before, and compute a pending
+ * LESC DH key from the main loop.  micro-ecc does the key in one go, so
+ * rather than stalling in the middle of a scroll it's started just after a
+ * frame has gone out.
+ */
 void ble_main(void) {
+  if (display_retry) {
+    uint32_t retry;
+    CRITICAL_REGION_ENTER();
+    retry = display_retry;
+    display_retry = 0;
+    CRITICAL_REGION_EXIT();
+    for (int type=0; retry; type++, retry >>= 1)
+      if (retry & 1)
+        ble_display_post(type);
+  }
+
+  if (!lesc_pending)
+    return;
+  uint32_t waited = app_timer_cnt_diff_compute(
+      app_timer_cnt_get(), lesc_requested_at);
+  if (waited < LESC_MAX_DEFER &&
+      display_frame_slack(ble_badge_svc.display) < LESC_MIN_SLACK)
+    return;
+
+  lesc_pending = false;
+  uint32_t start = app_timer_cnt_get();
   APP_ERROR_CHECK(ble_lesc_service_request_handler());
+  uint32_t ticks = app_timer_cnt_diff_compute(app_timer_cnt_get(), start);
+  lesc_stats.last_defer_ticks = waited;
+  lesc_stats.last_compute_ticks = ticks;
+  if (ticks > lesc_stats.max_compute_ticks)
+    lesc_stats.max_compute_ticks = ticks;
+  pairing_used_lesc = true;
+  TRACE("LESC DH key: waited %d, took %d ticks", waited, ticks);
+}
+
+const ble_lesc_stats_t *ble_manager_get_lesc_stats(void) {
+  return &lesc_stats;
+}
+
+bool ble_manager_is_connected() {
+  return link_count() > 0;
 }
 
 void ble_manager_start_advertising() {
+  if (m_adv_running) {
+    if (m_adv_tier == ADV_TIER_PAIRING &&
+        m_advertising.adv_mode_current != BLE_ADV_MODE_SLOW)
+      return;
+    // Open the pairing window again over slow or background advertising
+    sd_ble_gap_adv_stop(m_advertising.adv_handle);
+    m_adv_running = false;
+  }
   ble_advertising_setup();
+  m_adv_tier = ADV_TIER_PAIRING;
+  ble_advertising_modes_config_set(&m_advertising, &m_adv_modes);
+  ret_code_t rv = ble_advertising_start(&m_advertising, BLE_ADV_MODE_FAST);
 #ifdef BLE_ADVERTISE_37
-  MASK_CHANNEL(m_advertising.adv_params.channel_mask, 38);
-  MASK_CHANNEL(m_advertising.adv_params.channel_mask, 39);
+  if (rv == NRF_SUCCESS)
+    rv = adv_restrict_to_37();
 #endif
-  ret_code_t rv = ble_advertising_start(&m_advertising, BLE_ADV_MODE_FAST);
   if (rv == NRF_ERROR_CONN_COUNT) {
     NRF_LOG_ERROR("Can't advertise while connected.");
     joystick_enable();
@@ -117,13 +260,128 @@ void ble_manager_start_advertising() {
   if (rv != NRF_SUCCESS) {
     NRF_LOG_ERROR("Error advertising: %d", rv);
     joystick_enable();
+    return;
+  }
+  m_adv_running = true;
+}
+
+/**
+ * Keep advertising after a connection while there's a free link.  Unlike
+ * the pairing window this leaves the joystick and display alone.
+ */
+static void ble_advertising_resume() {
+  if (m_adv_running || link_count() >= BLE_MAX_LINKS)
+    return;
+  if (m_adv_tier != ADV_TIER_PAIRING) {
+    adv_background_start(adv_policy_tier());
+    return;
   }
+  ret_code_t rv = ble_advertising_start(&m_advertising, BLE_ADV_MODE_FAST);
+#ifdef BLE_ADVERTISE_37
+  if (rv == NRF_SUCCESS)
+    rv = adv_restrict_to_37();
+#endif
+  if (rv != NRF_SUCCESS) {
+    NRF_LOG_WARNING("Error resuming advertising: %d", rv);
+    return;
+  }
+  m_adv_running = true;
+}
+
+/**
+ * Advertise for bonded phones to reconnect, with no timeout.  Uses the
+ * advertising module's slow mode, reconfigured for the tier.
+ */
+static void adv_background_start(ble_adv_tier_t tier) {
+  ble_adv_modes_config_t config = m_adv_modes;
+  config.ble_adv_directed_enabled = false;
+  config.ble_adv_fast_enabled = false;
+  config.ble_adv_slow_interval = (tier == ADV_TIER_BEACON) ?
+    APP_ADV_BEACON_INTERVAL : APP_ADV_WARM_INTERVAL;
+  config.ble_adv_slow_timeout = 0;
+  ble_advertising_modes_config_set(&m_advertising, &config);
+  ret_code_t rv = ble_advertising_start(&m_advertising, BLE_ADV_MODE_SLOW);
+  if (rv == NRF_SUCCESS && tier == ADV_TIER_BEACON)
+    rv = adv_restrict_to_37();
+  if (rv != NRF_SUCCESS) {
+    NRF_LOG_WARNING("Error starting background advertising: %d", rv);
+    return;
+  }
+  m_adv_running = true;
+  m_adv_tier = tier;
+  TRACE("Advertising tier %d", tier);
+}
+
+/**
+ * Narrow the advertising just started to channel 37.
+ * ble_advertising_start() clears adv_params before configuring the set, so
+ * the mask can't go in beforehand: stop, reconfigure and start again.
+ */
+static ret_code_t adv_restrict_to_37() {
+  ret_code_t rv = sd_ble_gap_adv_stop(m_advertising.adv_handle);
+  if (rv != NRF_SUCCESS)
+    return rv;
+  MASK_CHANNEL(m_advertising.adv_params.channel_mask, 38);
+  MASK_CHANNEL(m_advertising.adv_params.channel_mask, 39);
+  rv = sd_ble_gap_adv_set_configure(&m_advertising.adv_handle,
+      &m_advertising.adv_data, &m_advertising.adv_params);
+  if (rv != NRF_SUCCESS)
+    return rv;
+  return sd_ble_gap_adv_start(
+      m_advertising.adv_handle, m_advertising.conn_cfg_tag);
+}
+
+static ble_adv_tier_t adv_policy_tier() {
+  return (power_idle_minutes() < ADV_BEACON_AFTER_MIN) ?
+    ADV_TIER_WARM : ADV_TIER_BEACON;
+}
+
+/**
+ * Timer callback: step the background advertising between tiers as the
+ * badge goes idle or gets used again.
+ */
+static void adv_policy_check(void *context) {
+  if (!m_adv_running || m_adv_tier == ADV_TIER_PAIRING)
+    return;
+  ble_adv_tier_t tier = adv_policy_tier();
+  if (tier == m_adv_tier)
+    return;
+  sd_ble_gap_adv_stop(m_advertising.adv_handle);
+  m_adv_running = false;
+  adv_background_start(tier);
+}
+
+static int link_index(uint16_t conn_handle) {
+  for (int i=0; i<BLE_MAX_LINKS; i++)
+    if (m_links[i] == conn_handle)
+      return i;
+  return -1;
+}
+
+/**
+ * Post a command that takes no value, keeping it for ble_main() to try
+ * again if the display's queue is full.
+ */
+static void ble_display_post(display_cmd_type_t type) {
+  if (display_post(ble_badge_svc.display, type, 0) == NRF_SUCCESS)
+    return;
+  CRITICAL_REGION_ENTER();
+  display_retry |= (1 << type);
+  CRITICAL_REGION_EXIT();
+}
+
+static int link_count() {
+  int count = 0;
+  for (int i=0; i<BLE_MAX_LINKS; i++)
+    if (m_links[i] != BLE_CONN_HANDLE_INVALID)
+      count++;
+  return count;
 }
 
 static void ble_advertising_setup() {
   NRF_LOG_INFO("Starting advertising...");
   joystick_disable();
-  display_show_pairing_code(ble_badge_svc.display, NULL);
+  ble_display_post(DISP_CMD_PAIRING_DONE);
   nrf_gpio_pin_clear(ADV_LED_PIN);
 }
 
@@ -142,11 +400,20 @@ static void ble_setup_badge_service(led_display *disp) {
         &ble_uuid,
         &ble_badge_svc.service_handle));
 
-  // Add the characteristics
+  // Add the characteristics.  Handles are handed out in order and bonded
+  // phones cache them, so new ones only ever go on the end.
   APP_ERROR_CHECK(ble_badge_add_onoff_characteristic());
   APP_ERROR_CHECK(ble_badge_add_brightness_characteristic());
   APP_ERROR_CHECK(ble_badge_add_index_characteristic());
   APP_ERROR_CHECK(ble_badge_add_message_characteristics());
+  APP_ERROR_CHECK(ble_badge_add_selftest_characteristic());
+  APP_ERROR_CHECK(ble_badge_add_db_hash_characteristic());
+  APP_ERROR_CHECK(ble_badge_add_config_characteristic());
+  display_set_state_cb(ble_badge_display_changed);
+  badge_config_init(disp);
+#if BLE_THROUGHPUT
+  ble_throughput_init(ble_badge_svc.uuid_type);
+#endif
 
   // Register event handler
   NRF_SDH_BLE_OBSERVER(
@@ -157,9 +424,16 @@ static void ble_error_handler(uint32_t nrf_error) {
   APP_ERROR_HANDLER(nrf_error);
 }
 
-/** GAP Parameters */
-static void gap_params_init() {
-  ble_gap_conn_params_t gap_conn_params;
+/**
+ * The radio is about to start, or has just finished.  Runs in the SWI1
+ * interrupt; the display keeps its frame transfers out of the way.
+ */
+static void radio_notification_handler(bool radio_active) {
+  display_radio_notify(ble_badge_svc.display, radio_active);
+}
+
+/** Set the GAP device name from device_name */
+static void device_name_apply() {
   ble_gap_conn_sec_mode_t sec_mode;
 
 #if BLE_SECURITY
@@ -172,6 +446,13 @@ static void gap_params_init() {
         &sec_mode,
         (uint8_t *)device_name,
         strlen(device_name)));
+}
+
+/** GAP Parameters */
+static void gap_params_init() {
+  ble_gap_conn_params_t gap_conn_params;
+
+  device_name_apply();
 
   gap_conn_params.min_conn_interval = MIN_CONN_INTERVAL;
   gap_conn_params.max_conn_interval = MAX_CONN_INTERVAL;
@@ -191,7 +472,7 @@ static void conn_params_error_handler(uint32_t nrf_error) {
 static void on_conn_params_evt(ble_conn_params_evt_t *p_evt) {
   if (p_evt->evt_type == BLE_CONN_PARAMS_EVT_FAILED) {
     NRF_LOG_WARNING("Failed negotiating connection parameters.");
-    sd_ble_gap_disconnect(m_conn_handle, BLE_HCI_CONN_INTERVAL_UNACCEPTABLE);
+    sd_ble_gap_disconnect(p_evt->conn_handle, BLE_HCI_CONN_INTERVAL_UNACCEPTABLE);
     return;
   }
 }
@@ -233,67 +514,105 @@ static void advertising_init() {
       .ble_adv_slow_enabled = true,
       .ble_adv_slow_interval = APP_ADV_SLOW_INTERVAL,
       .ble_adv_slow_timeout = APP_ADV_SLOW_TIMEOUT,
+      // Restarted by hand, see BLE_GAP_EVT_DISCONNECTED
+      .ble_adv_on_disconnect_disabled = true,
     },
     .error_handler = ble_error_handler,
   };
 
+  m_adv_modes = init.config;
   APP_ERROR_CHECK(ble_advertising_init(&m_advertising, &init));
   ble_advertising_conn_cfg_tag_set(&m_advertising, APP_BLE_CONN_CFG_TAG);
+  // From here on the payload is changed in place, see adv_data.c
+  APP_ERROR_CHECK(adv_data_init(&m_advertising, &init.advdata, device_name));
 }
 
 static void qwr_init() {
-  static uint8_t qwr_buf[256];
-  nrf_ble_qwr_init_t qwr_init = {
-    .error_handler = ble_error_handler,
-    .mem_buffer = {
-      .p_mem = qwr_buf,
-      .len = 256,
-    },
-    .callback = qwr_evt_handler,
-  };
-  APP_ERROR_CHECK(nrf_ble_qwr_init(&m_qwr, &qwr_init));
+  static uint8_t qwr_buf[BLE_MAX_LINKS][QWR_BUF_SIZE];
+  for (int i=0; i<BLE_MAX_LINKS; i++) {
+    nrf_ble_qwr_init_t qwr_init = {
+      .error_handler = ble_error_handler,
+      .mem_buffer = {
+        .p_mem = qwr_buf[i],
+        .len = QWR_BUF_SIZE,
+      },
+      .callback = qwr_evt_handler,
+    };
+    APP_ERROR_CHECK(nrf_ble_qwr_init(&m_qwr[i], &qwr_init));
+  }
 }
 
 static uint16_t qwr_evt_handler(struct nrf_ble_qwr_t *p_qwr, nrf_ble_qwr_evt_t *p_evt) {
+  if (p_evt->evt_type == NRF_BLE_QWR_EVT_EXECUTE_WRITE) {
+    // Otherwise it's one of the messages
+    if (p_evt->attr_handle == ble_badge_svc.config_handles.value_handle)
+      badge_config_post();
+    else
+      ble_display_post(DISP_CMD_MESSAGES);
+    return BLE_GATT_STATUS_SUCCESS;
+  }
   if (p_evt->evt_type != NRF_BLE_QWR_EVT_AUTH_REQUEST)
     return 0;
   return BLE_GATT_STATUS_SUCCESS;
 }
 
+/**
+ * MTU and data length are negotiated by the gatt module.
+ */
+static void gatt_evt_handler(nrf_ble_gatt_t *p_gatt, nrf_ble_gatt_evt_t const *p_evt) {
+  switch (p_evt->evt_id) {
+    case NRF_BLE_GATT_EVT_ATT_MTU_UPDATED:
+      EVT_DEBUG("ATT MTU now %d", p_evt->params.att_mtu_effective);
+      break;
+    case NRF_BLE_GATT_EVT_DATA_LENGTH_UPDATED:
+      EVT_DEBUG("Data length now %d", p_evt->params.data_length);
+      break;
+  }
+#if BLE_THROUGHPUT
+  ble_throughput_on_gatt_evt(p_evt);
+#endif
+}
+
 /** Handle BLE Events */
 static void ble_badge_on_ble_evt(ble_evt_t const *p_ble_evt, void *p_context) {
   switch (p_ble_evt->header.evt_id) {
     case BLE_GAP_EVT_CONNECTED:
-      EVT_DEBUG("Connected");
-      m_conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
-      nrf_ble_qwr_conn_handle_assign(&m_qwr, m_conn_handle);
+      {
+        uint16_t conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+        int idx = link_index(BLE_CONN_HANDLE_INVALID);
+        EVT_DEBUG("Connected: handle %d, slot %d", conn_handle, idx);
+        m_adv_running = false;
+        // The SoftDevice won't connect more than BLE_MAX_LINKS
+        if (idx < 0)
+          APP_ERROR_CHECK(NRF_ERROR_NO_MEM);
+        m_links[idx] = conn_handle;
+        nrf_ble_qwr_conn_handle_assign(&m_qwr[idx], conn_handle);
+        ble_advertising_resume();
+      }
       break;
     case BLE_GAP_EVT_DISCONNECTED:
-      EVT_DEBUG("Disconnected");
-      m_conn_handle = BLE_CONN_HANDLE_INVALID;
-      m_pending_conn_handle = BLE_CONN_HANDLE_INVALID;
-      display_show_pairing_code(ble_badge_svc.display, NULL);
-      // The advertising module will restart advertising automatically,
-      // so we put things back into advertising mode
-      ble_advertising_setup();
+      {
+        uint16_t conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+        int idx = link_index(conn_handle);
+        EVT_DEBUG("Disconnected: handle %d, slot %d", conn_handle, idx);
+        if (idx >= 0)
+          m_links[idx] = BLE_CONN_HANDLE_INVALID;
+        // Give them a full idle period after leaving before going to sleep
+        power_activity();
+        if (conn_handle == m_pending_conn_handle) {
+          m_pending_conn_handle = BLE_CONN_HANDLE_INVALID;
+          ble_display_post(DISP_CMD_PAIRING_DONE);
+        }
+        // Back into the pairing window, unless it's still open for
+        // another link
+        ble_manager_start_advertising();
+      }
       break;
     case BLE_GATTS_EVT_WRITE:
       EVT_DEBUG("GATTS Write event");
       uint16_t handle = p_ble_evt->evt.gatts_evt.params.write.handle;
       EVT_DEBUG("Handle: %d", handle);
-      if (handle == ble_badge_svc.onoff_handles.value_handle) {
-        ble_badge_handle_onoff_write(
-            p_ble_evt->evt.gatts_evt.params.write.data[0]);
-        break;
-      } else if (handle == ble_badge_svc.brightness_handles.value_handle) {
-        ble_badge_handle_brightness_write(
-            p_ble_evt->evt.gatts_evt.params.write.data[0]);
-        break;
-      } else if (handle == ble_badge_svc.index_handles.value_handle) {
-        ble_badge_handle_index_write(
-            p_ble_evt->evt.gatts_evt.params.write.data[0]);
-        break;
-      } else if (p_ble_evt->evt.gatts_evt.params.write.uuid.type
+      if (p_ble_evt->evt.gatts_evt.params.write.uuid.type
             == BLE_UUID_TYPE_BLE &&
           p_ble_evt->evt.gatts_evt.params.write.uuid.uuid
             == BLE_UUID_GAP_CHARACTERISTIC_DEVICE_NAME) {
@@ -303,14 +622,19 @@ static void ble_badge_on_ble_evt(ble_evt_t const *p_ble_evt, void *p_context) {
             == NRF_SUCCESS) {
           device_name[device_name_len] = '\0';
           save_device_name(device_name, device_name_len+1);
-          // TODO: might need to fix this
-          advertising_init();
+          adv_data_set_name(device_name);
         }
-      } else {
-        // Save all dirty messages
-        app_sched_event_put(NULL, 0, app_save_messages);
+      } else if (handle == ble_badge_svc.config_handles.value_handle &&
+          p_ble_evt->evt.gatts_evt.params.write.op !=
+          BLE_GATTS_OP_EXEC_WRITE_REQ_NOW) {
+        // Fits in one write once the MTU's been raised
+        badge_config_post();
       }
       break;
+    case BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST:
+      ble_badge_on_authorize(p_ble_evt->evt.gatts_evt.conn_handle,
+          &p_ble_evt->evt.gatts_evt.params.authorize_request);
+      break;
     case BLE_GATTS_EVT_TIMEOUT:
       EVT_DEBUG("GATTS Timeout");
       APP_ERROR_CHECK(sd_ble_gap_disconnect(
@@ -328,8 +652,8 @@ static void ble_badge_on_ble_evt(ble_evt_t const *p_ble_evt, void *p_context) {
         EVT_DEBUG("PHY Update request.");
         ble_gap_phys_t const phys =
         {
-          .rx_phys = BLE_GAP_PHY_AUTO,
-          .tx_phys = BLE_GAP_PHY_AUTO,
+          .rx_phys = BLE_PREFERRED_PHY,
+          .tx_phys = BLE_PREFERRED_PHY,
         };
         APP_ERROR_CHECK(sd_ble_gap_phy_update(
               p_ble_evt->evt.gap_evt.conn_handle, &phys));
@@ -337,36 +661,60 @@ static void ble_badge_on_ble_evt(ble_evt_t const *p_ble_evt, void *p_context) {
       break;
     case BLE_GAP_EVT_PASSKEY_DISPLAY:
       {
-        // Only display passkey when advertising
-        if (m_advertising.adv_mode_current == BLE_ADV_MODE_IDLE) {
+        uint16_t conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+        // Only display passkey in the pairing window
+        if (m_advertising.adv_mode_current == BLE_ADV_MODE_IDLE ||
+            m_adv_tier != ADV_TIER_PAIRING) {
           EVT_DEBUG("Not advertising, rejecting immediately.");
           uint8_t key_type = BLE_GAP_AUTH_KEY_TYPE_NONE;
           APP_ERROR_CHECK(sd_ble_gap_auth_key_reply(
-                m_pending_conn_handle, key_type, NULL));
+                conn_handle, key_type, NULL));
           break;
         }
-        joystick_disable();
-        char passkey[BLE_GAP_PASSKEY_LEN+1] = {0};
-        memcpy(&passkey, p_ble_evt->evt.gap_evt.params.passkey_display.passkey,
-            BLE_GAP_PASSKEY_LEN);
-        EVT_DEBUG("Passkey request, passkey=%s match_req=%d",
-            nrf_log_push(passkey),
+        EVT_DEBUG("Passkey request, match_req=%d",
             p_ble_evt->evt.gap_evt.params.passkey_display.match_request);
         if (p_ble_evt->evt.gap_evt.params.passkey_display.match_request) {
-          if (m_pending_conn_handle != BLE_CONN_HANDLE_INVALID) {
-            EVT_DEBUG("Another conn handle is pending...");
+          // One passkey on the display at a time; the other central can
+          // try again once this one's done
+          if (m_pending_conn_handle != BLE_CONN_HANDLE_INVALID &&
+              m_pending_conn_handle != conn_handle) {
+            EVT_DEBUG("Pairing %d pending, rejecting %d",
+                m_pending_conn_handle, conn_handle);
+            uint8_t key_type = BLE_GAP_AUTH_KEY_TYPE_NONE;
+            APP_ERROR_CHECK(sd_ble_gap_auth_key_reply(
+                  conn_handle, key_type, NULL));
+            break;
+          }
+          // A stale retry would take the new code straight back off
+          CRITICAL_REGION_ENTER();
+          display_retry &= ~(1 << DISP_CMD_PAIRING_DONE);
+          CRITICAL_REGION_EXIT();
+          if (display_post_pairing_code(ble_badge_svc.display,
+                (const char *)p_ble_evt->evt.gap_evt.params.passkey_display.passkey)
+              != NRF_SUCCESS) {
+            // Nobody would ever see it to confirm
+            NRF_LOG_WARNING("No room to show passkey, rejecting %d",
+                conn_handle);
+            uint8_t key_type = BLE_GAP_AUTH_KEY_TYPE_NONE;
+            APP_ERROR_CHECK(sd_ble_gap_auth_key_reply(
+                  conn_handle, key_type, NULL));
             break;
           }
-          m_pending_conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
-          display_show_pairing_code(ble_badge_svc.display, passkey);
+          joystick_disable();
+          m_pending_conn_handle = conn_handle;
         }
       }
       break;
     case BLE_GAP_EVT_ADV_SET_TERMINATED:
       EVT_DEBUG("ADV_SET_TERMINATED");
+      // The advertising module sees this first, and after the fast timeout
+      // has already moved on to slow by itself
+      m_adv_running = m_advertising.adv_mode_current != BLE_ADV_MODE_IDLE;
       nrf_gpio_pin_set(ADV_LED_PIN); // we use low, so this is "off"
-      display_show_pairing_code(ble_badge_svc.display, NULL);
+      ble_display_post(DISP_CMD_PAIRING_DONE);
       joystick_enable();
+      if (!m_adv_running && link_count() < BLE_MAX_LINKS)
+        adv_background_start(adv_policy_tier());
       break;
     case BLE_EVT_USER_MEM_REQUEST:
       sd_ble_user_mem_reply(p_ble_evt->evt.gap_evt.conn_handle, NULL);
@@ -382,19 +730,19 @@ static void ble_badge_on_ble_evt(ble_evt_t const *p_ble_evt, void *p_context) {
       break;
     case BLE_GAP_EVT_LESC_DHKEY_REQUEST:
       EVT_DEBUG("LESC_DHKEY_REQUEST");
+      lesc_requested_at = app_timer_cnt_get();
+      lesc_pending = true;
       break;
     default:
-      EVT_DEBUG("Unhandled BLE event: %s", (uint32_t)ble_evt_decode(p_ble_evt->header.evt_id));
+#if DEBUG_BLE
+      NRF_LOG_INFO("Unhandled BLE event: %s", (uint32_t)ble_evt_decode(p_ble_evt->header.evt_id));
+#endif
       break;
   }
 }
 
-static void app_save_messages(void *unused_ptr, uint16_t unused_size) {
-  display_save_storage();
-}
-
 void ble_match_request_respond(uint8_t matched) {
-  display_show_pairing_code(ble_badge_svc.display, NULL);
+  ble_display_post(DISP_CMD_PAIRING_DONE);
   joystick_enable();
   if (m_pending_conn_handle == BLE_CONN_HANDLE_INVALID)
     return;
@@ -411,8 +759,102 @@ void ble_match_request_respond(uint8_t matched) {
   m_pending_conn_handle = BLE_CONN_HANDLE_INVALID;
 }
 
-static void ble_badge_handle_onoff_write(uint8_t val) {
-  display_mode(ble_badge_svc.display, val & 1, 0);
+/**
+ * Writes to on/off, brightness and index are authorized rather than landing
+ * in the display's own fields, so the value only reaches it through the
+ * command queue.  The characteristics catch up in
+ * ble_badge_display_changed() once it's been applied.
+ *
+ * Message writes are authorized so the SoftDevice copies them into
+ * message_staging during the reply, from this interrupt, where
+ * display_commit_messages() can hold them off.  Long writes come through
+ * the qwr module the same way.
+ */
+static void ble_badge_on_authorize(uint16_t conn_handle,
+    ble_gatts_evt_rw_authorize_request_t const *req) {
+  if (req->type != BLE_GATTS_AUTHORIZE_TYPE_WRITE)
+    return;
+  ble_gatts_evt_write_t const *write = &req->request.write;
+  if (write->op == BLE_GATTS_OP_WRITE_REQ &&
+      ble_badge_is_message_handle(write->handle)) {
+    ble_gatts_rw_authorize_reply_params_t reply = {
+      .type = BLE_GATTS_AUTHORIZE_TYPE_WRITE,
+      .params.write = {
+        .gatt_status = BLE_GATT_STATUS_SUCCESS,
+        .update = 1,
+        .offset = write->offset,
+        .len = write->len,
+        .p_data = write->data,
+      },
+    };
+    // Committed and saved from the main loop, which can't run until the
+    // reply below has put the value in place
+    if (display_post(ble_badge_svc.display, DISP_CMD_MESSAGES, 0)
+        != NRF_SUCCESS) {
+      reply.params.write.gatt_status = BLE_GATT_STATUS_ATTERR_INSUF_RESOURCES;
+      reply.params.write.update = 0;
+    }
+    APP_ERROR_CHECK(sd_ble_gatts_rw_authorize_reply(conn_handle, &reply));
+    return;
+  }
+  display_cmd_type_t type;
+  uint8_t limit;
+  if (write->handle == ble_badge_svc.onoff_handles.value_handle) {
+    type = DISP_CMD_MODE;
+    limit = 1;
+  } else if (write->handle == ble_badge_svc.brightness_handles.value_handle) {
+    type = DISP_CMD_BRIGHTNESS;
+    limit = MAX_BRIGHTNESS;
+  } else if (write->handle == ble_badge_svc.index_handles.value_handle) {
+    type = DISP_CMD_SELECT;
+    limit = NUM_MESSAGES - 1;
+  } else {
+    // Queued writes, handled by the qwr module
+    return;
+  }
+
+  ble_gatts_rw_authorize_reply_params_t reply = {
+    .type = BLE_GATTS_AUTHORIZE_TYPE_WRITE,
+  };
+  if (write->op != BLE_GATTS_OP_WRITE_REQ || write->offset || write->len != 1)
+    reply.params.write.gatt_status =
+      BLE_GATT_STATUS_ATTERR_INVALID_ATT_VAL_LENGTH;
+  else if (write->data[0] > limit)
+    reply.params.write.gatt_status = BLE_GATT_STATUS_ATTERR_CPS_OUT_OF_RANGE;
+  else if (display_post(ble_badge_svc.display, type, write->data[0])
+      != NRF_SUCCESS)
+    reply.params.write.gatt_status = BLE_GATT_STATUS_ATTERR_INSUF_RESOURCES;
+  else
+    reply.params.write.gatt_status = BLE_GATT_STATUS_SUCCESS;
+  EVT_DEBUG("Authorize write %d: %d", write->handle,
+      reply.params.write.gatt_status);
+  APP_ERROR_CHECK(sd_ble_gatts_rw_authorize_reply(conn_handle, &reply));
+}
+
+/**
+ * The display's state changed, from the main loop.  Mirror it into the
+ * readable values.
+ */
+static void ble_badge_display_changed(led_display *disp) {
+  ble_badge_value_set(ble_badge_svc.onoff_handles.value_handle, disp->on);
+  ble_badge_value_set(ble_badge_svc.brightness_handles.value_handle,
+      disp->brightness);
+  // Leave the index alone while a pairing code is up
+  if (disp->cur_msg_idx >= 0)
+    ble_badge_value_set(ble_badge_svc.index_handles.value_handle,
+        disp->cur_msg_idx);
+}
+
+static void ble_badge_value_set(uint16_t handle, uint8_t val) {
+  ble_gatts_value_t value = {
+    .len = sizeof(val),
+    .offset = 0,
+    .p_value = &val,
+  };
+  ret_code_t rv = sd_ble_gatts_value_set(
+      BLE_CONN_HANDLE_INVALID, handle, &value);
+  if (rv != NRF_SUCCESS)
+    NRF_LOG_WARNING("Updating handle %d failed: %d", handle, rv);
 }
 
 static uint32_t ble_badge_add_onoff_characteristic() {
@@ -436,9 +878,10 @@ static uint32_t ble_badge_add_onoff_characteristic() {
   BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);  /*TODO: add security */
   BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm); /*TODO: add security */
 #endif
-  attr_md.vloc = BLE_GATTS_VLOC_USER;
+  attr_md.vloc = BLE_GATTS_VLOC_STACK;
   attr_md.rd_auth = 0;
-  attr_md.wr_auth = 0;
+  // See ble_badge_on_authorize()
+  attr_md.wr_auth = 1;
   attr_md.vlen = 0;
 
   attr_value.p_uuid = &ble_uuid;
@@ -457,10 +900,6 @@ static uint32_t ble_badge_add_onoff_characteristic() {
       &ble_badge_svc.onoff_handles);
 }
 
-static void ble_badge_handle_brightness_write(uint8_t val) {
-  display_set_brightness(ble_badge_svc.display, val);
-}
-
 static uint32_t ble_badge_add_brightness_characteristic() {
   ble_gatts_char_md_t char_md = {0};
   ble_gatts_attr_md_t attr_md = {0};
@@ -482,9 +921,10 @@ static uint32_t ble_badge_add_brightness_characteristic() {
   BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);  /*TODO: add security */
   BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm); /*TODO: add security */
 #endif
-  attr_md.vloc = BLE_GATTS_VLOC_USER;
+  attr_md.vloc = BLE_GATTS_VLOC_STACK;
   attr_md.rd_auth = 0;
-  attr_md.wr_auth = 0;
+  // See ble_badge_on_authorize()
+  attr_md.wr_auth = 1;
   attr_md.vlen = 0;
 
   attr_value.p_uuid = &ble_uuid;
@@ -503,13 +943,6 @@ static uint32_t ble_badge_add_brightness_characteristic() {
       &ble_badge_svc.brightness_handles);
 }
 
-static void ble_badge_handle_index_write(int8_t val) {
-  if (val < NUM_MESSAGES && val >= 0) {
-    ble_badge_svc.display->cur_msg_idx = val;
-    display_set_message(ble_badge_svc.display, &message_set[val]);
-  }
-}
-
 static uint32_t ble_badge_add_index_characteristic() {
   ble_gatts_char_md_t char_md = {0};
   ble_gatts_attr_md_t attr_md = {0};
@@ -531,9 +964,10 @@ static uint32_t ble_badge_add_index_characteristic() {
   BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);  /*TODO: add security */
   BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm); /*TODO: add security */
 #endif
-  attr_md.vloc = BLE_GATTS_VLOC_USER;
+  attr_md.vloc = BLE_GATTS_VLOC_STACK;
   attr_md.rd_auth = 0;
-  attr_md.wr_auth = 0;
+  // See ble_badge_on_authorize()
+  attr_md.wr_auth = 1;
   attr_md.vlen = 0;
 
   attr_value.p_uuid = &ble_uuid;
@@ -552,10 +986,17 @@ static uint32_t ble_badge_add_index_characteristic() {
       &ble_badge_svc.index_handles);
 }
 
+static bool ble_badge_is_message_handle(uint16_t handle) {
+  for (int i=0; i<NUM_MESSAGES; i++)
+    if (handle == ble_badge_svc.message_handles[i].value_handle)
+      return true;
+  return false;
+}
+
 static uint32_t ble_badge_add_message_characteristics() {
   uint32_t rv;
   for(uint16_t i=0; i<NUM_MESSAGES; i++) {
-    if ((rv = ble_badge_add_message_characteristic(&message_set[i], i)) != 0)
+    if ((rv = ble_badge_add_message_characteristic(&message_staging[i], i)) != 0)
       return rv;
   }
   return rv;
@@ -584,7 +1025,8 @@ static uint32_t ble_badge_add_message_characteristic(led_message *msg, uint16_t
 #endif
   attr_md.vloc = BLE_GATTS_VLOC_USER;
   attr_md.rd_auth = 0;
-  attr_md.wr_auth = 0;
+  // See ble_badge_on_authorize()
+  attr_md.wr_auth = 1;
   attr_md.vlen = 1;
 
   attr_value.p_uuid = &ble_uuid;
@@ -604,8 +1046,187 @@ static uint32_t ble_badge_add_message_characteristic(led_message *msg, uint16_t
     NRF_LOG_WARNING("Error in sd_ble_gatts_characteristic_add: %d", rv);
     return rv;
   }
-  return nrf_ble_qwr_attr_register(
-      &m_qwr, ble_badge_svc.message_handles[idx].value_handle);
+  for (int i=0; i<BLE_MAX_LINKS; i++) {
+    rv = nrf_ble_qwr_attr_register(
+        &m_qwr[i], ble_badge_svc.message_handles[idx].value_handle);
+    if (rv != NRF_SUCCESS)
+      return rv;
+  }
+  return NRF_SUCCESS;
+}
+
+/**
+ * Read-only view of the last selftest's results, for factory QA.
+ */
+static uint32_t ble_badge_add_selftest_characteristic() {
+  ble_gatts_char_md_t char_md = {0};
+  ble_gatts_attr_md_t attr_md = {0};
+  ble_gatts_attr_t    attr_value = {0};
+  ble_uuid_t          ble_uuid;
+  static char char_desc[] = "Selftest";
+
+  char_md.char_props.read = 1;
+  char_md.p_char_user_desc = (uint8_t *)char_desc;
+  char_md.char_user_desc_size = strlen(char_desc);
+  char_md.char_user_desc_max_size = char_md.char_user_desc_size;
+
+#if BLE_SECURITY
+  BLE_GAP_CONN_SEC_MODE_SET_LESC_ENC_WITH_MITM(&attr_md.read_perm);
+#else
+  BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);  /*TODO: add security */
+#endif
+  BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.write_perm);
+  attr_md.vloc = BLE_GATTS_VLOC_USER;
+  attr_md.rd_auth = 0;
+  attr_md.wr_auth = 0;
+  attr_md.vlen = 0;
+
+  attr_value.p_uuid = &ble_uuid;
+  attr_value.p_attr_md = &attr_md;
+  attr_value.init_len = sizeof(selftest_results_t);
+  attr_value.init_offs = 0;
+  attr_value.max_len = sizeof(selftest_results_t);
+  attr_value.p_value = (uint8_t *)selftest_get_results();
+
+  ble_uuid.type = ble_badge_svc.uuid_type;
+  ble_uuid.uuid = BADGE_SELFTEST_UUID;
+  return sd_ble_gatts_characteristic_add(
+      ble_badge_svc.service_handle,
+      &char_md,
+      &attr_value,
+      &ble_badge_svc.selftest_handles);
+}
+
+/**
+ * Hash of the attribute table, so a client with handles cached from an
+ * earlier connection can tell whether they're still good.
+ */
+static uint32_t ble_badge_add_db_hash_characteristic() {
+  ble_gatts_char_md_t char_md = {0};
+  ble_gatts_attr_md_t attr_md = {0};
+  ble_gatts_attr_t    attr_value = {0};
+  ble_uuid_t          ble_uuid;
+  static char char_desc[] = "DB Hash";
+
+  char_md.char_props.read = 1;
+  char_md.p_char_user_desc = (uint8_t *)char_desc;
+  char_md.char_user_desc_size = strlen(char_desc);
+  char_md.char_user_desc_max_size = char_md.char_user_desc_size;
+
+  // Readable before pairing, it's needed to decide whether to rediscover
+  BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+  BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.write_perm);
+  attr_md.vloc = BLE_GATTS_VLOC_USER;
+  attr_md.rd_auth = 0;
+  attr_md.wr_auth = 0;
+  attr_md.vlen = 0;
+
+  attr_value.p_uuid = &ble_uuid;
+  attr_value.p_attr_md = &attr_md;
+  attr_value.init_len = sizeof(db_hash);
+  attr_value.init_offs = 0;
+  attr_value.max_len = sizeof(db_hash);
+  attr_value.p_value = (uint8_t *)&db_hash;
+
+  ble_uuid.type = ble_badge_svc.uuid_type;
+  ble_uuid.uuid = BADGE_DB_HASH_UUID;
+  return sd_ble_gatts_characteristic_add(
+      ble_badge_svc.service_handle,
+      &char_md,
+      &attr_value,
+      &ble_badge_svc.db_hash_handles);
+}
+
+/**
+ * Write-only config bundle, see badge_config.c.  Usually a long write, so
+ * it's registered with qwr like the messages.
+ */
+static uint32_t ble_badge_add_config_characteristic() {
+  ble_gatts_char_md_t char_md = {0};
+  ble_gatts_attr_md_t attr_md = {0};
+  ble_gatts_attr_t    attr_value = {0};
+  ble_uuid_t          ble_uuid;
+  static char char_desc[] = "Config";
+
+  char_md.char_props.write = 1;
+  char_md.p_char_user_desc = (uint8_t *)char_desc;
+  char_md.char_user_desc_size = strlen(char_desc);
+  char_md.char_user_desc_max_size = char_md.char_user_desc_size;
+
+  BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.read_perm);
+#if BLE_SECURITY
+  BLE_GAP_CONN_SEC_MODE_SET_LESC_ENC_WITH_MITM(&attr_md.write_perm);
+#else
+  BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm); /*TODO: add security */
+#endif
+  attr_md.vloc = BLE_GATTS_VLOC_USER;
+  attr_md.rd_auth = 0;
+  attr_md.wr_auth = 0;
+  attr_md.vlen = 0;
+
+  attr_value.p_uuid = &ble_uuid;
+  attr_value.p_attr_md = &attr_md;
+  attr_value.init_len = sizeof(badge_config_t);
+  attr_value.init_offs = 0;
+  attr_value.max_len = sizeof(badge_config_t);
+  attr_value.p_value = (uint8_t *)&config_staging;
+
+  ble_uuid.type = ble_badge_svc.uuid_type;
+  ble_uuid.uuid = BADGE_CONFIG_UUID;
+  ret_code_t rv = sd_ble_gatts_characteristic_add(
+      ble_badge_svc.service_handle,
+      &char_md,
+      &attr_value,
+      &ble_badge_svc.config_handles);
+  if (rv != NRF_SUCCESS)
+    return rv;
+  for (int i=0; i<BLE_MAX_LINKS; i++) {
+    rv = nrf_ble_qwr_attr_register(
+        &m_qwr[i], ble_badge_svc.config_handles.value_handle);
+    if (rv != NRF_SUCCESS)
+      return rv;
+  }
+  return NRF_SUCCESS;
+}
+
+/**
+ * Walk the attribute table.  Values aren't included, only what a client
+ * would cache from discovery.
+ */
+static void db_hash_compute() {
+  uint32_t crc = 0;
+  for (uint16_t handle=1; ; handle++) {
+    ble_uuid_t uuid;
+    if (sd_ble_gatts_attr_get(handle, &uuid, NULL) != NRF_SUCCESS)
+      break;
+    uint8_t entry[] = {
+      handle & 0xFF, handle >> 8,
+      uuid.type,
+      uuid.uuid & 0xFF, uuid.uuid >> 8,
+    };
+    crc = crc32_compute(entry, sizeof(entry), &crc);
+  }
+  db_hash = crc;
+  NRF_LOG_INFO("Attribute table hash: %08x", db_hash);
+}
+
+/**
+ * If the table has changed since the last boot, have the peer manager
+ * send Service Changed to each bonded peer when it next connects.
+ */
+static void db_hash_check() {
+  static uint32_t saved_hash;
+  int len = sizeof(saved_hash);
+  ret_code_t rv = get_db_hash(&saved_hash, &len);
+  if (rv == NRF_SUCCESS && len == sizeof(saved_hash) && saved_hash == db_hash)
+    return;
+  // Not stored yet means firmware from before there was a hash, which
+  // bonded peers may still have cached
+  NRF_LOG_INFO("Attribute table changed, notifying bonded peers.");
+  APP_ERROR_CHECK(pm_local_database_has_changed());
+  // FDS writes from this after we return
+  saved_hash = db_hash;
+  save_db_hash(&saved_hash, sizeof(saved_hash));
 }
 
 static void pm_evt_handler(pm_evt_t const *p_evt) {
@@ -615,16 +1236,32 @@ static void pm_evt_handler(pm_evt_t const *p_evt) {
       break;
     case PM_EVT_CONN_SEC_START:
       EVT_DEBUG("PM_EVT_CONN_SEC_START: peer_id=%d", p_evt->peer_id);
+      pairing_started_at = app_timer_cnt_get();
+      pairing_used_lesc = false;
       break;
     case PM_EVT_CONN_SEC_SUCCEEDED:
       EVT_DEBUG("PM_EVT_CONN_SEC_SUCCEEDED: conn_handle=%d, procedure=%d",
           p_evt->conn_handle, p_evt->params.conn_sec_succeeded.procedure);
+      if (pairing_used_lesc) {
+        uint32_t ticks = app_timer_cnt_diff_compute(
+            app_timer_cnt_get(), pairing_started_at);
+        lesc_stats.pairings++;
+        lesc_stats.last_pairing_ticks = ticks;
+        if (ticks > lesc_stats.max_pairing_ticks)
+          lesc_stats.max_pairing_ticks = ticks;
+        pairing_used_lesc = false;
+        NRF_LOG_INFO("LESC pairing took %d ms, DH key stalled %d ms.",
+            ticks * 1000 / APP_TIMER_CLOCK_FREQ,
+            lesc_stats.last_compute_ticks * 1000 / APP_TIMER_CLOCK_FREQ);
+      }
       break;
     case PM_EVT_CONN_SEC_FAILED:
       EVT_DEBUG("PM_EVT_CONN_SEC_FAILED: conn_handle=%d, error=%d",
           p_evt->conn_handle, p_evt->params.conn_sec_failed.error);
-      m_pending_conn_handle = BLE_CONN_HANDLE_INVALID;
-      display_show_pairing_code(ble_badge_svc.display, NULL);
+      if (p_evt->conn_handle == m_pending_conn_handle) {
+        m_pending_conn_handle = BLE_CONN_HANDLE_INVALID;
+        ble_display_post(DISP_CMD_PAIRING_DONE);
+      }
       // Reset the bond
       pm_peer_delete(p_evt->peer_id);
       break;
@@ -637,7 +1274,7 @@ static void pm_evt_handler(pm_evt_t const *p_evt) {
       break;
     case PM_EVT_STORAGE_FULL:
       // garbage collect
-      fds_gc();
+      storage_gc_emergency();
       break;
     case PM_EVT_PEER_DATA_UPDATE_FAILED:
       APP_ERROR_CHECK(p_evt->params.peer_data_update_failed.error);
@@ -1,6 +1,7 @@
 #ifndef _BLE_MANAGER_
 #define _BLE_MANAGER_
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "led_display.h"
@@ -17,6 +18,19 @@
 // BLE_SECURITY can be disabled for debugging
 #define BLE_SECURITY 1
 
+// Debug service for measuring throughput, see ble_throughput.c.  Build
+// with `make THROUGHPUT=1`, which also raises the MTU and data length and
+// moves RAM to suit.
+#ifndef BLE_THROUGHPUT
+# define BLE_THROUGHPUT 0
+#endif
+
+#if BLE_THROUGHPUT
+# define BLE_PREFERRED_PHY      BLE_GAP_PHY_2MBPS
+#else
+# define BLE_PREFERRED_PHY      BLE_GAP_PHY_AUTO
+#endif
+
 #define DEVICE_NAME             "DC26_Badge"
 #define MANUFACTURER_NAME       "AttackerCommunity"
 
@@ -26,6 +40,12 @@
 #define APP_BLE_OBSERVER_PRIO   3
 #define APP_BLE_CONN_CFG_TAG    1
 
+// Centrals that can be connected at once, each with its own qwr context
+#define BLE_MAX_LINKS           NRF_SDH_BLE_PERIPHERAL_LINK_COUNT
+// Queued write buffer per link.  Holds a config bundle as 18 byte prepare
+// writes, 6 bytes of header each.
+#define QWR_BUF_SIZE            288
+
 #define MIN_CONN_INTERVAL       MSEC_TO_UNITS(30, UNIT_1_25_MS)
 #define MAX_CONN_INTERVAL       MSEC_TO_UNITS(150, UNIT_1_25_MS)
 #define SLAVE_LATENCY           5
@@ -50,6 +70,12 @@
 #define SEC_PARAM_MAX_KEY_SIZE  16
 #define BLE_GAP_LESC_P256_SK_LEN 32
 
+// The LESC DH key blocks the main loop for the whole computation, so it
+// waits for a gap this long before the next display frame, but holds
+// pairing up no more than LESC_MAX_DEFER
+#define LESC_MIN_SLACK          APP_TIMER_TICKS(150)
+#define LESC_MAX_DEFER          APP_TIMER_TICKS(500)
+
 #define BADGE_SERVICE_BASE      { 0xd5, 0xc4, 0x19, 0x3c, \
                                   0x63, 0x8c, 0xf7, 0xac, \
                                   0x06, 0x47, 0x7e, 0xe8, \
@@ -59,6 +85,9 @@
 #define BADGE_INDEX_UUID        0x4343
 #define BADGE_BRIGHTNESS_UUID   0x4444
 #define BADGE_MSG_UUID          0x4545
+#define BADGE_SELFTEST_UUID     0x4646
+#define BADGE_DB_HASH_UUID      0x4747
+#define BADGE_CONFIG_UUID       0x4848
 
 #define APP_ADV_FAST_INTERVAL   0x0028
 #define APP_ADV_FAST_TIMEOUT    3000
@@ -66,12 +95,44 @@
 #define APP_ADV_SLOW_INTERVAL   0x0c80  // 2 sec in 0.625ms time slice
 #define APP_ADV_SLOW_TIMEOUT    180000
 
+// Once the pairing window closes, keep advertising for bonded phones: at
+// the slow interval while the badge is in use, then as a beacon on one
+// channel after ADV_BEACON_AFTER_MIN without a button press or connection
+#define APP_ADV_WARM_INTERVAL   APP_ADV_SLOW_INTERVAL
+#define APP_ADV_BEACON_INTERVAL 0x2000  // 5.12 sec
+#define ADV_BEACON_AFTER_MIN    10
+#define ADV_POLICY_INTERVAL     APP_TIMER_TICKS(60000)
+
+// Radio notifications come this far ahead of each radio event.  A display
+// frame takes about 1.7 ms at 100 kHz, so one started before the notice
+// is done before the radio starts.
+#define RADIO_NOTIFICATION_DISTANCE NRF_RADIO_NOTIFICATION_DISTANCE_2680US
+
+typedef enum {
+  ADV_TIER_PAIRING,   // Fast then slow, new pairings allowed
+  ADV_TIER_WARM,      // Bonded phones only, APP_ADV_WARM_INTERVAL
+  ADV_TIER_BEACON,    // Bonded phones only, APP_ADV_BEACON_INTERVAL on 37
+} ble_adv_tier_t;
+
 #if defined(BOARD_BADGE)
 # define ADV_LED_PIN  10
 #elif defined(BOARD_PROTO)
 # define ADV_LED_PIN  20
 #endif
 
+// LESC timings, in RTC ticks
+typedef struct {
+  uint16_t pairings;
+  // Time spent waiting for a gap in the display
+  uint32_t last_defer_ticks;
+  // Main loop stall computing the DH key
+  uint32_t last_compute_ticks;
+  uint32_t max_compute_ticks;
+  // CONN_SEC_START to CONN_SEC_SUCCEEDED
+  uint32_t last_pairing_ticks;
+  uint32_t max_pairing_ticks;
+} ble_lesc_stats_t;
+
 typedef struct _ble_badge_service_s ble_badge_service_t;
 
 typedef void (*ble_message_write_handler_t) (uint16_t, ble_badge_service_t *, uint8_t);
@@ -82,14 +143,21 @@ typedef struct _ble_badge_service_s {
   ble_gatts_char_handles_t    brightness_handles;
   ble_gatts_char_handles_t    index_handles;
   ble_gatts_char_handles_t    message_handles[NUM_MESSAGES];
+  ble_gatts_char_handles_t    selftest_handles;
+  ble_gatts_char_handles_t    db_hash_handles;
+  ble_gatts_char_handles_t    config_handles;
   uint8_t                     uuid_type;
   ble_message_write_handler_t message_write_handler;
   led_display                 *display;
 } ble_badge_service_t;
 
 void ble_stack_init(led_display *disp);
+void ble_manager_load_storage(void);
 void ble_match_request_respond(uint8_t matched);
 void ble_main(void);
 void ble_manager_start_advertising(void);
+bool ble_manager_is_connected(void);
+ret_code_t ble_manager_set_device_name(const char *name);
+const ble_lesc_stats_t *ble_manager_get_lesc_stats(void);
 
 #endif /* _BLE_MANAGER */
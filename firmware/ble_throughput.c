@@ -0,0 +1,265 @@
+/**
+ * Throughput test service.
+ *
+ * A write-without-response sink and a notification source, with counters
+ * for each direction.  Subscribing to the source sends
+ * THROUGHPUT_SOURCE_BYTES as fast as the link will take them.  Goodput is
+ * bytes * APP_TIMER_CLOCK_FREQ / ticks.
+ */
+
+#include "ble_throughput.h"
+
+#if BLE_THROUGHPUT
+
+#include <string.h>
+
+#include "app_error.h"
+#include "app_timer.h"
+#include "ble_srv_common.h"
+#include "nrf_log.h"
+#include "nrf_sdh_ble.h"
+
+#include "trace.h"
+
+static void throughput_on_ble_evt(ble_evt_t const *p_ble_evt, void *p_context);
+static uint32_t throughput_add_char(uint16_t uuid, uint8_t props,
+    uint8_t *value, uint16_t len, ble_gatts_char_handles_t *handles);
+static void throughput_source_pump();
+static void throughput_report();
+
+#define PROP_READ           (1 << 0)
+#define PROP_WRITE          (1 << 1)
+#define PROP_WRITE_WO_RESP  (1 << 2)
+#define PROP_NOTIFY         (1 << 3)
+
+static uint8_t uuid_type;
+static uint16_t service_handle;
+static ble_gatts_char_handles_t sink_handles;
+static ble_gatts_char_handles_t source_handles;
+static ble_gatts_char_handles_t counters_handles;
+
+static uint16_t conn_handle = BLE_CONN_HANDLE_INVALID;
+static ble_throughput_stats_t stats = {0};
+// Incoming data lands here; its contents never matter, so the source sends
+// from it too
+static uint8_t payload[THROUGHPUT_MAX_PAYLOAD];
+static bool source_running = false;
+static uint32_t source_queued;
+static uint16_t source_len;
+static uint32_t rx_start;
+static uint32_t tx_start;
+
+void ble_throughput_init(uint8_t type) {
+  uuid_type = type;
+  ble_uuid_t ble_uuid = {
+    .type = uuid_type,
+    .uuid = THROUGHPUT_SERVICE_UUID,
+  };
+  APP_ERROR_CHECK(sd_ble_gatts_service_add(
+        BLE_GATTS_SRVC_TYPE_PRIMARY,
+        &ble_uuid,
+        &service_handle));
+  APP_ERROR_CHECK(throughput_add_char(
+        THROUGHPUT_SINK_UUID, PROP_WRITE_WO_RESP,
+        payload, sizeof(payload), &sink_handles));
+  APP_ERROR_CHECK(throughput_add_char(
+        THROUGHPUT_SOURCE_UUID, PROP_NOTIFY,
+        payload, sizeof(payload), &source_handles));
+  APP_ERROR_CHECK(throughput_add_char(
+        THROUGHPUT_COUNTERS_UUID, PROP_READ | PROP_WRITE,
+        (uint8_t *)&stats, sizeof(stats), &counters_handles));
+
+  // Let connection events run on while there's data to send
+  ble_opt_t opt = {0};
+  opt.common_opt.conn_evt_ext.enable = 1;
+  APP_ERROR_CHECK(sd_ble_opt_set(BLE_COMMON_OPT_CONN_EVT_EXT, &opt));
+
+  NRF_SDH_BLE_OBSERVER(
+      m_throughput_observer, APP_BLE_OBSERVER_PRIO,
+      throughput_on_ble_evt, NULL);
+  NRF_LOG_INFO("Throughput service up, max payload %d.",
+      THROUGHPUT_MAX_PAYLOAD);
+}
+
+/**
+ * The gatt module negotiates MTU and data length; just note what we got.
+ */
+void ble_throughput_on_gatt_evt(nrf_ble_gatt_evt_t const *p_evt) {
+  switch (p_evt->evt_id) {
+    case NRF_BLE_GATT_EVT_ATT_MTU_UPDATED:
+      stats.att_mtu = p_evt->params.att_mtu_effective;
+      break;
+    case NRF_BLE_GATT_EVT_DATA_LENGTH_UPDATED:
+      stats.data_length = p_evt->params.data_length;
+      break;
+  }
+}
+
+const ble_throughput_stats_t *ble_throughput_get_stats(void) {
+  return &stats;
+}
+
+static void throughput_on_ble_evt(ble_evt_t const *p_ble_evt, void *p_context) {
+  ble_gatts_evt_write_t const *write;
+
+  switch (p_ble_evt->header.evt_id) {
+    case BLE_GAP_EVT_CONNECTED:
+      {
+        conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+        memset(&stats, 0, sizeof(stats));
+        stats.att_mtu = BLE_GATT_ATT_MTU_DEFAULT;
+        stats.phy = BLE_GAP_PHY_1MBPS;
+        // Ask for 2M straight away rather than waiting for the phone
+        ble_gap_phys_t const phys = {
+          .rx_phys = BLE_GAP_PHY_2MBPS,
+          .tx_phys = BLE_GAP_PHY_2MBPS,
+        };
+        APP_ERROR_CHECK(sd_ble_gap_phy_update(conn_handle, &phys));
+      }
+      break;
+    case BLE_GAP_EVT_DISCONNECTED:
+      // Only the most recent link is measured
+      if (p_ble_evt->evt.gap_evt.conn_handle != conn_handle)
+        break;
+      if (stats.rx_packets || stats.tx_packets)
+        throughput_report();
+      conn_handle = BLE_CONN_HANDLE_INVALID;
+      source_running = false;
+      break;
+    case BLE_GAP_EVT_PHY_UPDATE:
+      if (p_ble_evt->evt.gap_evt.params.phy_update.status ==
+          BLE_HCI_STATUS_CODE_SUCCESS)
+        stats.phy = p_ble_evt->evt.gap_evt.params.phy_update.tx_phy;
+      break;
+    case BLE_GATTS_EVT_WRITE:
+      write = &p_ble_evt->evt.gatts_evt.params.write;
+      if (write->handle == sink_handles.value_handle) {
+        uint32_t now = app_timer_cnt_get();
+        if (!stats.rx_packets)
+          rx_start = now;
+        stats.rx_packets++;
+        stats.rx_bytes += write->len;
+        stats.rx_ticks = app_timer_cnt_diff_compute(now, rx_start);
+      } else if (write->handle == counters_handles.value_handle) {
+        uint16_t mtu = stats.att_mtu;
+        uint8_t data_length = stats.data_length, phy = stats.phy;
+        memset(&stats, 0, sizeof(stats));
+        stats.att_mtu = mtu;
+        stats.data_length = data_length;
+        stats.phy = phy;
+      } else if (write->handle == source_handles.cccd_handle &&
+          write->len == 2) {
+        source_running = ble_srv_is_notification_enabled(write->data);
+        if (!source_running)
+          break;
+        stats.tx_bytes = 0;
+        stats.tx_packets = 0;
+        stats.tx_ticks = 0;
+        source_queued = 0;
+        source_len = stats.att_mtu - 3;
+        tx_start = app_timer_cnt_get();
+        throughput_source_pump();
+      }
+      break;
+    case BLE_GATTS_EVT_HVN_TX_COMPLETE:
+      if (!source_running)
+        break;
+      stats.tx_packets += p_ble_evt->evt.gatts_evt.params.hvn_tx_complete.count;
+      stats.tx_bytes +=
+        p_ble_evt->evt.gatts_evt.params.hvn_tx_complete.count * source_len;
+      stats.tx_ticks = app_timer_cnt_diff_compute(
+          app_timer_cnt_get(), tx_start);
+      if (stats.tx_bytes >= THROUGHPUT_SOURCE_BYTES) {
+        source_running = false;
+        throughput_report();
+        break;
+      }
+      throughput_source_pump();
+      break;
+  }
+}
+
+/**
+ * Queue notifications until the SoftDevice runs out of buffers.
+ */
+static void throughput_source_pump() {
+  while (source_queued < THROUGHPUT_SOURCE_BYTES) {
+    uint16_t len = source_len;
+    ble_gatts_hvx_params_t hvx = {
+      .type = BLE_GATT_HVX_NOTIFICATION,
+      .handle = source_handles.value_handle,
+      .p_data = payload,
+      .p_len = &len,
+    };
+    ret_code_t rv = sd_ble_gatts_hvx(conn_handle, &hvx);
+    if (rv == NRF_ERROR_RESOURCES)
+      return;
+    if (rv != NRF_SUCCESS) {
+      NRF_LOG_WARNING("Throughput source stopped: %d", rv);
+      source_running = false;
+      return;
+    }
+    source_queued += source_len;
+  }
+}
+
+static void throughput_report() {
+  NRF_LOG_INFO("Throughput: MTU %d, data length %d, PHY %d",
+      stats.att_mtu, stats.data_length, stats.phy);
+  if (stats.rx_ticks)
+    NRF_LOG_INFO("  sink: %d bytes in %d packets, %d B/s",
+        stats.rx_bytes, stats.rx_packets, (uint32_t)(
+          ((uint64_t)stats.rx_bytes * APP_TIMER_CLOCK_FREQ) / stats.rx_ticks));
+  if (stats.tx_ticks)
+    NRF_LOG_INFO("  source: %d bytes in %d packets, %d B/s",
+        stats.tx_bytes, stats.tx_packets, (uint32_t)(
+          ((uint64_t)stats.tx_bytes * APP_TIMER_CLOCK_FREQ) / stats.tx_ticks));
+  TRACE("Throughput rx %d B in %d ticks", stats.rx_bytes, stats.rx_ticks);
+  TRACE("Throughput tx %d B in %d ticks", stats.tx_bytes, stats.tx_ticks);
+}
+
+static uint32_t throughput_add_char(uint16_t uuid, uint8_t props,
+    uint8_t *value, uint16_t len, ble_gatts_char_handles_t *handles) {
+  ble_gatts_char_md_t char_md = {0};
+  ble_gatts_attr_md_t attr_md = {0};
+  ble_gatts_attr_md_t cccd_md = {0};
+  ble_gatts_attr_t attr_value = {0};
+  ble_uuid_t ble_uuid;
+
+  char_md.char_props.read = (props & PROP_READ) != 0;
+  char_md.char_props.write = (props & PROP_WRITE) != 0;
+  char_md.char_props.write_wo_resp = (props & PROP_WRITE_WO_RESP) != 0;
+  char_md.char_props.notify = (props & PROP_NOTIFY) != 0;
+
+#if BLE_SECURITY
+  BLE_GAP_CONN_SEC_MODE_SET_LESC_ENC_WITH_MITM(&attr_md.read_perm);
+  BLE_GAP_CONN_SEC_MODE_SET_LESC_ENC_WITH_MITM(&attr_md.write_perm);
+  BLE_GAP_CONN_SEC_MODE_SET_LESC_ENC_WITH_MITM(&cccd_md.write_perm);
+#else
+  BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+  BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+  BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.write_perm);
+#endif
+  BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+  cccd_md.vloc = BLE_GATTS_VLOC_STACK;
+  if (props & PROP_NOTIFY)
+    char_md.p_cccd_md = &cccd_md;
+
+  attr_md.vloc = BLE_GATTS_VLOC_USER;
+  attr_md.rd_auth = 0;
+  attr_md.wr_auth = 0;
+  attr_md.vlen = (props & (PROP_WRITE_WO_RESP | PROP_NOTIFY)) != 0;
+
+  attr_value.p_uuid = &ble_uuid;
+  attr_value.p_attr_md = &attr_md;
+  attr_value.init_len = len;
+  attr_value.max_len = len;
+  attr_value.p_value = value;
+
+  ble_uuid.type = uuid_type;
+  ble_uuid.uuid = uuid;
+  return sd_ble_gatts_characteristic_add(
+      service_handle, &char_md, &attr_value, handles);
+}
+
+#endif /* BLE_THROUGHPUT */
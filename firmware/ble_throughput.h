@@ -0,0 +1,38 @@
+#ifndef _BLE_THROUGHPUT_H_
+#define _BLE_THROUGHPUT_H_
+
+#include <stdint.h>
+
+#include "ble.h"
+#include "nrf_ble_gatt.h"
+
+#include "ble_manager.h"
+
+#define THROUGHPUT_SERVICE_UUID   0x5151
+#define THROUGHPUT_SINK_UUID      0x5252
+#define THROUGHPUT_SOURCE_UUID    0x5353
+#define THROUGHPUT_COUNTERS_UUID  0x5454
+
+// Notifications sent each time the source is subscribed to
+#define THROUGHPUT_SOURCE_BYTES   (64 * 1024)
+#define THROUGHPUT_MAX_PAYLOAD    (NRF_SDH_BLE_GATT_MAX_MTU_SIZE - 3)
+
+// Read from the counters characteristic, any write resets it.  Times are
+// RTC ticks from the first packet to the last.
+typedef struct {
+  uint32_t rx_bytes;
+  uint32_t rx_packets;
+  uint32_t rx_ticks;
+  uint32_t tx_bytes;
+  uint32_t tx_packets;
+  uint32_t tx_ticks;
+  uint16_t att_mtu;
+  uint8_t data_length;
+  uint8_t phy;
+} ble_throughput_stats_t;
+
+void ble_throughput_init(uint8_t uuid_type);
+void ble_throughput_on_gatt_evt(nrf_ble_gatt_evt_t const *p_evt);
+const ble_throughput_stats_t *ble_throughput_get_stats(void);
+
+#endif /* _BLE_THROUGHPUT_H_ */
@@ -0,0 +1,199 @@
+/**
+ * Staged boot sequence.
+ *
+ * Anything that doesn't need flash (display, BLE) is brought up straight
+ * away.  FDS-dependent stages run from the scheduler once FDS reports it is
+ * ready, and patch their state into the already-running display and BLE.
+ */
+
+#include "boot.h"
+
+#include "app_scheduler.h"
+#include "app_timer.h"
+#include "nrf_log.h"
+
+#include "ble_manager.h"
+#include "power.h"
+#include "selftest.h"
+#include "storage.h"
+
+#define TICKS_TO_MS(t) \
+  ((uint32_t)(((uint64_t)(t) * 1000) / APP_TIMER_CLOCK_FREQ))
+
+typedef struct {
+  boot_stage_t stage;
+  uint32_t ticks;
+} boot_mark_t;
+
+static void boot_ble_start();
+static void boot_event_put(app_sched_event_handler_t handler);
+static void boot_storage_ready();
+static void boot_storage_stage(void *unused_ptr, uint16_t unused_size);
+static void boot_reset_done();
+static void boot_reset_stage(void *unused_ptr, uint16_t unused_size);
+static void boot_restore_stage(void *unused_ptr, uint16_t unused_size);
+static void boot_selftest_done();
+static void boot_load_stage();
+static void boot_report();
+
+static const char * const stage_names[BOOT_NUM_STAGES] = {
+  [BOOT_STAGE_CORE] = "core",
+  [BOOT_STAGE_FIRST_PIXEL] = "first pixel",
+  [BOOT_STAGE_FIRST_ADV] = "first adv",
+  [BOOT_STAGE_STORAGE] = "storage",
+  [BOOT_STAGE_RESET] = "reset",
+  [BOOT_STAGE_SELFTEST] = "selftest",
+  [BOOT_STAGE_RESTORE] = "restore",
+};
+
+// Stage completion times, in the order they happened
+static boot_mark_t marks[BOOT_NUM_STAGES];
+static uint8_t num_marks = 0;
+
+static led_display *display = NULL;
+static storage_erase_t factory_reset = 0;
+static bool selftest_requested = false;
+static bool first_boot = false;
+
+static led_message boot_message = {
+  .update = MSG_WARGAMES,
+  .speed = 2,
+};
+
+/**
+ * Record that a stage has completed.
+ */
+void boot_mark(boot_stage_t stage) {
+  if (num_marks >= BOOT_NUM_STAGES)
+    return;
+  marks[num_marks].stage = stage;
+  marks[num_marks].ticks = app_timer_cnt_get();
+  num_marks++;
+}
+
+/**
+ * Put the boot animation on the display.
+ */
+void boot_show_animation(led_display *disp) {
+  // Not a real message, so next/prev do nothing until we're restored.
+  disp->cur_msg_idx = -1;
+  message_set_text(&boot_message, "BOOTING");
+  display_set_message(disp, &boot_message);
+  boot_mark(BOOT_STAGE_FIRST_PIXEL);
+}
+
+/**
+ * Coming out of System OFF, the HT16K33 still has the last frame in its RAM,
+ * so just turn it back on and leave it there until the message is restored.
+ */
+void boot_show_resume(led_display *disp) {
+  disp->cur_msg_idx = -1;
+  disp->cur_message = NULL;
+  display_on(disp);
+  boot_mark(BOOT_STAGE_FIRST_PIXEL);
+}
+
+/**
+ * Kick off the rest of boot.  Returns without waiting for flash.  reset
+ * selects which records to wipe first, or 0 for none.  selftest runs the
+ * selftest even if this isn't the first boot.
+ */
+void boot_start(led_display *disp, storage_erase_t reset, bool selftest) {
+  display = disp;
+  factory_reset = reset;
+  selftest_requested = selftest;
+  storage_init(boot_storage_ready);
+  // A reset may wipe the peer manager's files, so hold BLE back until the
+  // erase is done.
+  if (!factory_reset)
+    boot_ble_start();
+}
+
+static void boot_ble_start() {
+  NRF_LOG_INFO("Setting up BLE.");
+  ble_stack_init(display);
+  boot_mark(BOOT_STAGE_FIRST_ADV);
+}
+
+static void boot_event_put(app_sched_event_handler_t handler) {
+  APP_ERROR_CHECK(app_sched_event_put(NULL, 0, handler));
+}
+
+/**
+ * FDS callback, may be in interrupt context.
+ */
+static void boot_storage_ready() {
+  boot_event_put(boot_storage_stage);
+}
+
+static void boot_storage_stage(void *unused_ptr, uint16_t unused_size) {
+  boot_mark(BOOT_STAGE_STORAGE);
+  if (factory_reset) {
+    NRF_LOG_INFO("Resetting device! (0x%x)", factory_reset);
+    storage_erase(factory_reset, boot_reset_done);
+    return;
+  }
+  boot_restore_stage(NULL, 0);
+}
+
+/**
+ * FDS callback, may be in interrupt context.
+ */
+static void boot_reset_done() {
+  boot_event_put(boot_reset_stage);
+}
+
+static void boot_reset_stage(void *unused_ptr, uint16_t unused_size) {
+  NRF_LOG_INFO("Reset done!");
+  boot_mark(BOOT_STAGE_RESET);
+  boot_ble_start();
+  boot_restore_stage(NULL, 0);
+}
+
+static void boot_restore_stage(void *unused_ptr, uint16_t unused_size) {
+  // A full reset takes the firstboot flag with it.
+  first_boot = storage_check_firstboot();
+  if (first_boot || selftest_requested) {
+    selftest_start(display, boot_selftest_done);
+    return;
+  }
+  boot_load_stage();
+}
+
+/**
+ * Selftest passed, from the main loop.
+ */
+static void boot_selftest_done() {
+  if (first_boot)
+    storage_finish_firstboot();
+  boot_mark(BOOT_STAGE_SELFTEST);
+  boot_load_stage();
+}
+
+static void boot_load_stage() {
+  display_load_storage();
+  // It went to sleep off, but somebody just pressed a button to wake it.
+  if (display_load_state(display, power_woke_from_off()) != NRF_SUCCESS) {
+    display_set_message(display, NULL);
+    if (power_woke_from_off())
+      display_on(display);
+  }
+  ble_manager_load_storage();
+  boot_mark(BOOT_STAGE_RESTORE);
+  boot_report();
+}
+
+/**
+ * Dump the per-stage boot time breakdown.
+ */
+static void boot_report() {
+  uint32_t last = 0;
+  NRF_LOG_INFO("%s time breakdown (ms since timer start):",
+      (uint32_t)(power_woke_from_off() ? "Wake" : "Boot"));
+  for (int i=0; i<num_marks; i++) {
+    uint32_t now = TICKS_TO_MS(marks[i].ticks);
+    NRF_LOG_INFO("  %s: %d ms (+%d ms)",
+        (uint32_t)stage_names[marks[i].stage], now, now - last);
+    last = now;
+  }
+}
@@ -0,0 +1,25 @@
+#ifndef _BOOT_H_
+#define _BOOT_H_
+
+#include <stdbool.h>
+
+#include "led_display.h"
+#include "storage.h"
+
+typedef enum {
+  BOOT_STAGE_CORE,          // Logging, scheduler, timers, TWI, crypto
+  BOOT_STAGE_FIRST_PIXEL,   // Boot animation (or last frame) is on the display
+  BOOT_STAGE_FIRST_ADV,     // SoftDevice enabled, advertising started
+  BOOT_STAGE_STORAGE,       // FDS is ready
+  BOOT_STAGE_RESET,         // Factory reset finished
+  BOOT_STAGE_SELFTEST,      // Selftest finished
+  BOOT_STAGE_RESTORE,       // Messages and device name loaded from flash
+  BOOT_NUM_STAGES,
+} boot_stage_t;
+
+void boot_mark(boot_stage_t stage);
+void boot_show_animation(led_display *disp);
+void boot_show_resume(led_display *disp);
+void boot_start(led_display *disp, storage_erase_t reset, bool selftest);
+
+#endif /* _BOOT_H_ */
@@ -3,13 +3,41 @@
 #include "ble_manager.h"
 #include "nrf_log.h"
 #include "app_timer.h"
+#include "app_util_platform.h"
+#include "nrfx_gpiote.h"
+#include "lanes.h"
+#include "power.h"
+#include "trace.h"
 
 #define RETURN_IF(x) \
   if((x)) return
 
+#define IS_STEP(a) ((a) == BUTTON_PUSH || (a) == BUTTON_REPEAT)
+
 #define LONG_PRESS APP_TIMER_TICKS(2000)
+#define DEBOUNCE_TICKS APP_TIMER_TICKS(BUTTON_DEBOUNCE_MS)
+
+#define NUM_BUTTONS 5
+#define NO_BUTTON 0xFF
+
+typedef struct {
+  uint8_t pin;
+  // Debounced state, true when pushed
+  bool pushed;
+  // Ignoring edges until the debounce timer fires
+  bool locked;
+  // RTC ticks at the GPIOTE event for the last push
+  uint32_t push_ticks;
+} button_state_t;
 
-static void handle_joystick_button(uint8_t pin_no, uint8_t button_action);
+static void button_gpiote_handler(
+    nrfx_gpiote_pin_t pin, nrf_gpiote_polarity_t action);
+static void button_debounce_handler(void *context);
+static void button_sample(int i, uint32_t now);
+static void button_repeat_handler(void *context);
+static void handle_joystick_button(int i, uint8_t button_action);
+static void joystick_action(void *context);
+static void latency_record(uint32_t ticks);
 static void handle_ble_button(uint8_t pin_no, uint8_t button_action);
 
 static bool joystick_enabled = 0;
@@ -17,17 +45,59 @@ static bool selftest_enabled = 0;
 static ble_callback_t *ble_accept_cb = NULL;
 static led_display *display = NULL;
 
+static button_state_t button_state[NUM_BUTTONS] = {
+  {.pin = JOYSTICK_CENTER},
+  {.pin = JOYSTICK_UP},
+  {.pin = JOYSTICK_LEFT},
+  {.pin = JOYSTICK_RIGHT},
+  {.pin = JOYSTICK_DOWN},
+};
+static app_timer_t debounce_timer_data[NUM_BUTTONS];
+static app_timer_id_t debounce_timers[NUM_BUTTONS];
+
+APP_TIMER_DEF(repeat_tmr);
+static volatile uint8_t repeat_pin = NO_BUTTON;
+static uint32_t repeat_interval;
+
+static button_latency_t latency = {.min_ticks = UINT32_MAX};
+
+/**
+ * Set up the joystick.  Each pin gets a GPIOTE port event on both edges;
+ * the first edge is acted on at once and the pin is then left alone for
+ * BUTTON_DEBOUNCE_MS, so debouncing adds nothing to the response time.
+ */
 void buttons_init(led_display *disp) {
   display = disp;
-  const static app_button_cfg_t buttons[] = {
-    DEF_BUTTON(JOYSTICK_CENTER, handle_joystick_button),
-    DEF_BUTTON(JOYSTICK_UP, handle_joystick_button),
-    DEF_BUTTON(JOYSTICK_LEFT, handle_joystick_button),
-    DEF_BUTTON(JOYSTICK_RIGHT, handle_joystick_button),
-    DEF_BUTTON(JOYSTICK_DOWN, handle_joystick_button),
-  };
-  APP_ERROR_CHECK(app_button_init(buttons, ARRAY_SIZE(buttons), 50));
-  APP_ERROR_CHECK(app_button_enable());
+  nrfx_gpiote_in_config_t config = NRFX_GPIOTE_CONFIG_IN_SENSE_TOGGLE(false);
+  config.pull = NRF_GPIO_PIN_PULLUP;
+  for (int i=0; i<NUM_BUTTONS; i++) {
+    debounce_timers[i] = &debounce_timer_data[i];
+    APP_ERROR_CHECK(app_timer_create(
+          &debounce_timers[i],
+          APP_TIMER_MODE_SINGLE_SHOT,
+          button_debounce_handler));
+    APP_ERROR_CHECK(nrfx_gpiote_in_init(
+          button_state[i].pin, &config, button_gpiote_handler));
+    button_state[i].pushed = !nrf_gpio_pin_read(button_state[i].pin);
+    nrfx_gpiote_in_event_enable(button_state[i].pin, true);
+  }
+  APP_ERROR_CHECK(app_timer_create(
+        &repeat_tmr,
+        APP_TIMER_MODE_SINGLE_SHOT,
+        button_repeat_handler));
+}
+
+/**
+ * Stop listening to the joystick and put the pins back to their defaults.
+ */
+void buttons_disable() {
+  app_timer_stop(repeat_tmr);
+  repeat_pin = NO_BUTTON;
+  for (int i=0; i<NUM_BUTTONS; i++) {
+    nrfx_gpiote_in_event_disable(button_state[i].pin);
+    nrfx_gpiote_in_uninit(button_state[i].pin);
+    app_timer_stop(debounce_timers[i]);
+  }
 }
 
 void joystick_set_enable(uint8_t enabled) {
@@ -43,59 +113,167 @@ void buttons_set_ble_accept_callback(ble_callback_t *ble_cb) {
 }
 
 bool is_center_pushed() {
-  return app_button_is_pushed(0);
+  return !nrf_gpio_pin_read(JOYSTICK_CENTER);
 }
 
 int get_buttons_pushed() {
   int rv = 0;
-  int buttons[] = {JOYSTICK_CENTER, JOYSTICK_UP, JOYSTICK_LEFT, JOYSTICK_RIGHT, JOYSTICK_DOWN};
-  for (int i = 0; i<ARRAY_SIZE(buttons); i++) {
-    if (app_button_is_pushed(i)) {
-      rv |= 1 << buttons[i];
+  for (int i = 0; i<NUM_BUTTONS; i++) {
+    if (!nrf_gpio_pin_read(button_state[i].pin)) {
+      rv |= 1 << button_state[i].pin;
     }
   }
   return rv;
 }
 
-static void handle_joystick_button(uint8_t pin_no, uint8_t button_action) {
+const button_latency_t *buttons_get_latency() {
+  return &latency;
+}
+
+/**
+ * GPIOTE event, in interrupt context.
+ */
+static void button_gpiote_handler(
+    nrfx_gpiote_pin_t pin, nrf_gpiote_polarity_t action) {
+  uint32_t now = app_timer_cnt_get();
+  for (int i=0; i<NUM_BUTTONS; i++) {
+    if (button_state[i].pin != pin)
+      continue;
+    if (!button_state[i].locked)
+      button_sample(i, now);
+    return;
+  }
+}
+
+/**
+ * End of a debounce window.  Catch anything that changed while we weren't
+ * looking, e.g. a release that bounced.
+ */
+static void button_debounce_handler(void *context) {
+  int i = (int)(uint32_t)context;
+  CRITICAL_REGION_ENTER();
+  button_state[i].locked = false;
+  button_sample(i, app_timer_cnt_get());
+  CRITICAL_REGION_EXIT();
+}
+
+/**
+ * Read a pin and, if it's changed, act on it and start ignoring it for
+ * a debounce window.
+ */
+static void button_sample(int i, uint32_t now) {
+  button_state_t *b = &button_state[i];
+  bool pushed = !nrf_gpio_pin_read(b->pin);
+  if (pushed == b->pushed)
+    return;
+  b->pushed = pushed;
+  b->locked = true;
+  APP_ERROR_CHECK(app_timer_start(
+        debounce_timers[i], DEBOUNCE_TICKS, (void *)(uint32_t)i));
+  if (pushed)
+    b->push_ticks = now;
+  handle_joystick_button(i, pushed ? BUTTON_PUSH : BUTTON_RELEASE);
+}
+
+/**
+ * Keep a held direction going, a little faster each time.
+ */
+static void button_repeat_handler(void *context) {
+  uint8_t pin = repeat_pin;
+  if (pin == NO_BUTTON || !joystick_enabled)
+    return;
+  lane_put(LANE_HIGH, joystick_action,
+      (void *)(uint32_t)((pin << 8) | BUTTON_REPEAT));
+  power_activity();
+  APP_ERROR_CHECK(app_timer_start(
+        repeat_tmr, APP_TIMER_TICKS(repeat_interval), NULL));
+  repeat_interval = repeat_interval * 3 / 4;
+  if (repeat_interval < BUTTON_REPEAT_MIN_MS)
+    repeat_interval = BUTTON_REPEAT_MIN_MS;
+}
+
+static void handle_joystick_button(int i, uint8_t button_action) {
   if (selftest_enabled)
     return;
-  static uint32_t button_down_time;
-  if (button_action == APP_BUTTON_PUSH)
-    button_down_time = app_timer_cnt_get();
+  uint8_t pin_no = button_state[i].pin;
+  power_activity();
+
+  if (pin_no == JOYSTICK_CENTER) {
+    if (button_action == BUTTON_RELEASE &&
+        app_timer_cnt_diff_compute(
+          app_timer_cnt_get(), button_state[i].push_ticks) > LONG_PRESS)
+      button_action = BUTTON_LONG_RELEASE;
+  } else if (button_action == BUTTON_PUSH) {
+    repeat_pin = pin_no;
+    repeat_interval = BUTTON_REPEAT_START_MS;
+    app_timer_stop(repeat_tmr);
+    APP_ERROR_CHECK(app_timer_start(
+          repeat_tmr, APP_TIMER_TICKS(BUTTON_REPEAT_DELAY_MS), NULL));
+  } else if (repeat_pin == pin_no) {
+    repeat_pin = NO_BUTTON;
+    app_timer_stop(repeat_tmr);
+  }
+
+  // The index goes along so the action can find the push time
+  lane_put(LANE_HIGH, joystick_action,
+      (void *)(uint32_t)((pin_no << 8) | (i << 4) | button_action));
+}
+
+/**
+ * Act on a button, from the high priority lane.
+ */
+static void joystick_action(void *context) {
+  uint8_t pin_no = ((uint32_t)context >> 8) & 0xFF;
+  uint8_t button_index = ((uint32_t)context >> 4) & 0xF;
+  uint8_t button_action = (uint32_t)context & 0xF;
+  uint32_t last_tx = display->last_tx_ticks;
   if(!joystick_enabled) {
     if (pin_no == BUTTON_BLE_PAIR || pin_no == BUTTON_BLE_REJECT)
       handle_ble_button(pin_no, button_action);
     return;
   }
-  NRF_LOG_INFO("Joystick button %s: %d",
-      (uint32_t)(button_action == APP_BUTTON_PUSH ? "pushed" : "released"),
-      (uint32_t)pin_no);
+  TRACE("Joystick button %d action %d", pin_no, button_action);
   switch (pin_no) {
     case JOYSTICK_UP:
-      RETURN_IF(button_action != APP_BUTTON_PUSH);
+      RETURN_IF(!IS_STEP(button_action));
       display_prev_message(display);
       break;
     case JOYSTICK_DOWN:
-      RETURN_IF(button_action != APP_BUTTON_PUSH);
+      RETURN_IF(!IS_STEP(button_action));
       display_next_message(display);
       break;
     case JOYSTICK_LEFT:
-      RETURN_IF(button_action != APP_BUTTON_PUSH);
+      RETURN_IF(!IS_STEP(button_action));
       display_dec_brightness(display);
       break;
     case JOYSTICK_RIGHT:
-      RETURN_IF(button_action != APP_BUTTON_PUSH);
+      RETURN_IF(!IS_STEP(button_action));
       display_inc_brightness(display);
       break;
     case JOYSTICK_CENTER:
-      RETURN_IF(button_action == APP_BUTTON_PUSH);
-      if (app_timer_cnt_diff_compute(app_timer_cnt_get(), button_down_time) > LONG_PRESS)
-        handle_ble_button(pin_no, button_action);
-      break;
+      RETURN_IF(button_action != BUTTON_LONG_RELEASE);
+      handle_ble_button(pin_no, button_action);
+      return;
     default:
-      NRF_LOG_INFO("Unknown joystick movement: %d", pin_no);
+      TRACE("Unknown joystick movement: %d", pin_no);
+      return;
   }
+  // Only a real push has an edge to measure from, and only if something
+  // went out to the display.
+  if (button_action == BUTTON_PUSH && display->last_tx_ticks != last_tx)
+    latency_record(app_timer_cnt_diff_compute(
+          display->last_tx_ticks, button_state[button_index].push_ticks));
+}
+
+static void latency_record(uint32_t ticks) {
+  TRACE("Press to photon: %d ticks", ticks);
+  latency.count++;
+  latency.last_ticks = ticks;
+  latency.total_ticks += ticks;
+  if (ticks < latency.min_ticks)
+    latency.min_ticks = ticks;
+  if (ticks > latency.max_ticks)
+    latency.max_ticks = ticks;
 }
 
 static void handle_ble_button(uint8_t pin_no, uint8_t button_action) {
@@ -103,7 +281,7 @@ static void handle_ble_button(uint8_t pin_no, uint8_t button_action) {
     ble_manager_start_advertising();
     return;
   }
-  RETURN_IF(button_action != APP_BUTTON_PUSH);
+  RETURN_IF(button_action != BUTTON_PUSH);
   NRF_LOG_INFO("BLE button pressed: %d", (uint32_t)pin_no);
   if (!ble_accept_cb)
     return;
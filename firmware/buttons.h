@@ -3,7 +3,7 @@
 
 #include <stdint.h>
 
-#include "app_button.h"
+#include "app_timer.h"
 #include "nrf_gpio.h"
 
 #include "led_display.h"
@@ -31,9 +31,36 @@
 #define BUTTON_BLE_PAIR     JOYSTICK_UP
 #define BUTTON_BLE_REJECT   JOYSTICK_DOWN
 
+// Button actions passed to handlers
+#define BUTTON_RELEASE      0
+#define BUTTON_PUSH         1
+// In place of BUTTON_RELEASE after a long press on the center
+#define BUTTON_LONG_RELEASE 2
+// A held direction repeating
+#define BUTTON_REPEAT       3
+
+// Edges are acted on straight away, then ignored for this long
+#define BUTTON_DEBOUNCE_MS      20
+// Held directions repeat after BUTTON_REPEAT_DELAY_MS, starting at
+// BUTTON_REPEAT_START_MS apart and speeding up to BUTTON_REPEAT_MIN_MS
+#define BUTTON_REPEAT_DELAY_MS  500
+#define BUTTON_REPEAT_START_MS  250
+#define BUTTON_REPEAT_MIN_MS    60
+
+// Press-to-photon: from the GPIOTE edge to the end of the I2C transfer it
+// caused, in RTC ticks
+typedef struct {
+  uint32_t count;
+  uint32_t last_ticks;
+  uint32_t min_ticks;
+  uint32_t max_ticks;
+  uint32_t total_ticks;
+} button_latency_t;
+
 typedef void ble_callback_t(uint8_t);
 
 void buttons_init(led_display *);
+void buttons_disable();
 void joystick_set_enable(uint8_t enable);
 void joystick_set_selftest(uint8_t enabled);
 #define joystick_enable() joystick_set_enable(true)
@@ -41,12 +68,6 @@ void joystick_set_selftest(uint8_t enabled);
 void buttons_set_ble_accept_callback(ble_callback_t *ble_cb);
 bool is_center_pushed();
 int get_buttons_pushed();
-
-#define DEF_BUTTON(n, handler) { \
-  .pin_no = (n), \
-  .active_state = APP_BUTTON_ACTIVE_LOW, \
-  .pull_cfg = NRF_GPIO_PIN_PULLUP, \
-  .button_handler = (handler), \
-}
+const button_latency_t *buttons_get_latency();
 
 #endif /* _BUTTONS_H_ */
@@ -0,0 +1,98 @@
+#include "lanes.h"
+
+#include <stdint.h>
+
+#include "app_timer.h"
+#include "app_util_platform.h"
+#include "trace.h"
+
+typedef struct {
+  lane_handler_t *handler;
+  void *context;
+  uint32_t queued_at;
+} lane_item_t;
+
+typedef struct {
+  lane_item_t items[LANE_QUEUE_SIZE];
+  uint8_t head;
+  uint8_t count;
+  lane_stats_t stats;
+} lane_queue_t;
+
+static bool lane_run_one(lane_t lane);
+
+static lane_queue_t lanes[NUM_LANES] = {0};
+
+/**
+ * Queue work on a lane.  Returns NRF_ERROR_NO_MEM and counts a drop if the
+ * lane is full.
+ */
+ret_code_t lane_put(lane_t lane, lane_handler_t *handler, void *context) {
+  lane_queue_t *q = &lanes[lane];
+  ret_code_t rv = NRF_SUCCESS;
+  uint32_t now = app_timer_cnt_get();
+
+  CRITICAL_REGION_ENTER();
+  if (q->count == LANE_QUEUE_SIZE) {
+    q->stats.dropped++;
+    rv = NRF_ERROR_NO_MEM;
+  } else {
+    lane_item_t *item = &q->items[(q->head + q->count) % LANE_QUEUE_SIZE];
+    item->handler = handler;
+    item->context = context;
+    item->queued_at = now;
+    if (++q->count > q->stats.max_depth)
+      q->stats.max_depth = q->count;
+  }
+  CRITICAL_REGION_EXIT();
+  return rv;
+}
+
+/**
+ * Run all the high priority work, then one piece of low priority work.
+ */
+void lanes_execute(void) {
+  while (lane_run_one(LANE_HIGH));
+  lane_run_one(LANE_LOW);
+}
+
+bool lanes_pending(void) {
+  return lanes[LANE_HIGH].count || lanes[LANE_LOW].count;
+}
+
+const lane_stats_t *lane_get_stats(lane_t lane) {
+  return &lanes[lane].stats;
+}
+
+static bool lane_run_one(lane_t lane) {
+  lane_queue_t *q = &lanes[lane];
+  lane_item_t item;
+  bool found = false;
+
+  CRITICAL_REGION_ENTER();
+  if (q->count) {
+    item = q->items[q->head];
+    q->head = (q->head + 1) % LANE_QUEUE_SIZE;
+    q->count--;
+    found = true;
+  }
+  CRITICAL_REGION_EXIT();
+  if (!found)
+    return false;
+
+  uint32_t start = app_timer_cnt_get();
+  uint32_t wait = app_timer_cnt_diff_compute(start, item.queued_at);
+  item.handler(item.context);
+  uint32_t run = app_timer_cnt_diff_compute(app_timer_cnt_get(), start);
+
+  q->stats.runs++;
+  if (wait > q->stats.max_wait_ticks) {
+    q->stats.max_wait_ticks = wait;
+    TRACE("Lane %d max wait: %d ticks", lane, wait);
+  }
+  if (run > q->stats.max_run_ticks) {
+    q->stats.max_run_ticks = run;
+    TRACE("Lane %d max run: %d ticks", lane, run);
+  }
+  return true;
+}
@@ -0,0 +1,42 @@
+#ifndef _LANES_H_
+#define _LANES_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sdk_errors.h"
+
+/**
+ * Two-lane work queue run from the main loop alongside app_scheduler.
+ *
+ * Everything queued on LANE_HIGH runs before each item from LANE_LOW, and
+ * app_sched_execute() gets a turn between LOW items, so input and pairing
+ * never wait behind more than one piece of rendering or flash work.
+ * lane_put() is safe from interrupts.
+ */
+
+typedef enum {
+  LANE_HIGH,    // Input, pairing responses, display commands
+  LANE_LOW,     // Rendering, FDS saves, GC
+  NUM_LANES,
+} lane_t;
+
+#define LANE_QUEUE_SIZE 8
+
+typedef void lane_handler_t(void *context);
+
+typedef struct {
+  uint32_t runs;
+  uint16_t dropped;
+  uint8_t max_depth;
+  // From lane_put() to the handler starting, and handler run time
+  uint32_t max_wait_ticks;
+  uint32_t max_run_ticks;
+} lane_stats_t;
+
+ret_code_t lane_put(lane_t lane, lane_handler_t *handler, void *context);
+void lanes_execute(void);
+bool lanes_pending(void);
+const lane_stats_t *lane_get_stats(lane_t lane);
+
+#endif /* _LANES_H_ */
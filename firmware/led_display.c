@@ -2,14 +2,16 @@
 
 #include <string.h>
 
-#include "app_scheduler.h"
+#include "app_util_platform.h"
 #include "nrf_log.h"
 #include "ble_gap.h"
 #include "crc16.h"
 #include "nrf_crypto.h"
 
+#include "lanes.h"
 #include "led_display.h"
 #include "storage.h"
+#include "trace.h"
 
 #define CMD_WRITE_RAM 0x00
 #define CMD_DIMMING 0xe0
@@ -17,18 +19,42 @@
 #define CMD_DISPLAY 0x80
 
 #define DISP_UPDATE_FREQUENCY_MS 50
+// Longest the display timer sleeps, well inside the RTC wrap
+#define DISP_IDLE_TICKS APP_TIMER_TICKS(60000)
+#define DISP_JITTER_REPORT_TICKS APP_TIMER_TICKS(60000)
 #define WARGAMES_MATCH_BITS 5
 #define WARGAMES_MATCH_MASK ((1 << WARGAMES_MATCH_BITS) - 1)
 #define WARGAMES_MATCH(x) (((x) & WARGAMES_MATCH_MASK) == WARGAMES_MATCH_MASK)
 #define WARGAMES_HOLD_TIME 0x400
+#define WARGAMES_LOCK_BLINK DISP_BLINK_1HZ
 
 #define RANDOM_BUF_SZ 128
 
 static inline ret_code_t display_i2c_send(
     led_display *disp, const uint8_t const *data, uint8_t len);
 static void display_timer_handler(void *context);
-static void display_update_callback(void *event_data, uint16_t event_size);
+static void display_timer_schedule(led_display *disp);
+static void display_restart_phase(led_display *disp);
+static uint32_t display_next_change(led_display *disp, uint32_t pos);
+static bool display_wargames_locked(led_display *disp);
 static void display_update(led_display *disp);
+static int message_len(const led_message *msg);
+static int message_copy(const led_message *msg, int pos, char *dest, int n);
+static ret_code_t display_standby(led_display *disp);
+static ret_code_t display_wake(led_display *disp);
+static void display_render(void *context);
+static bool display_render_post(led_display *disp);
+static bool display_radio_defer(led_display *disp);
+static void display_state_save(void *context);
+static ret_code_t display_state_write(led_display *disp);
+static void display_cmd_run(void *context);
+static void display_cmd_retry(void *context);
+static void display_commit_messages(led_display *disp);
+static void display_commit_retry(void *context);
+static void display_save_post(void *unused);
+static void display_save_messages(void *unused);
+static void display_state_timer_handler(void *context);
+static void display_state_publish(led_display *disp);
 static void refresh_crcs();
 static uint16_t crc_message(unsigned int i);
 static bool message_crc_dirty(unsigned int i);
@@ -38,33 +64,94 @@ static void cook_random();
 static const char scroll_loop_separator[] = SCROLL_LOOP_SEPARATOR;
 
 /**
- * Storage for available messages.
+ * BLE writes land in message_staging, which is what the characteristics
+ * point at.  They're authorized, so the SoftDevice only writes it while
+ * replying from the BLE event interrupt, and a critical region keeps them
+ * out.  display_commit_messages() copies it into whichever of
+ * message_tables isn't live and swaps message_set over, so the renderer and
+ * FDS never see a message half written.  Text is packed from default_text
+ * at init.
  */
-led_message message_set[NUM_MESSAGES] = {
+led_message message_staging[NUM_MESSAGES] = {
   {
-    .message = "HACK THE PLANET",
     .update = MSG_SCROLL_LOOP,
     .speed = 8,
   },
   {
-    .message = "HACK ALL THE THINGS",
     .update = MSG_SCROLL_LOOP,
     .speed = 8,
   },
   {
-    .message = "WARGAMES",
     .update = MSG_WARGAMES,
     .speed = 8,
   },
   {
-    .message = "ATTACKER COMMUNITY",
     .update = MSG_SCROLL_LOOP,
     .speed = 8,
   }
 };
 
+static led_message message_tables[2][NUM_MESSAGES];
+led_message *message_set = message_tables[0];
+
+static const char * const default_text[NUM_MESSAGES] = {
+  "HACK THE PLANET",
+  "HACK ALL THE THINGS",
+  "WARGAMES",
+  "ATTACKER COMMUNITY",
+};
+
+// What message records and writes looked like before text was packed
+typedef struct {
+  message_update_t update;
+  uint16_t speed;
+  char message[36];
+  uint8_t blink;
+} __attribute__ ((packed, aligned(4))) legacy_led_message;
+
+// Flash records and the BLE characteristic are this exact layout
+STATIC_ASSERT(sizeof(led_message) == sizeof(legacy_led_message),
+    "led_message changed size");
+
+typedef struct {
+  display_cmd_type_t type;
+  union {
+    uint8_t value;
+    char code[BLE_GAP_PASSKEY_LEN];
+  };
+} display_cmd_t;
+
+// Commands waiting for the main loop
+static struct {
+  display_cmd_t cmds[DISPLAY_CMD_QUEUE_SIZE];
+  uint8_t head;
+  uint8_t count;
+  // display_cmd_run() is already on a lane
+  bool queued;
+} cmd_queue;
+
 // Check for dirty messages.
 static uint16_t message_crcs[NUM_MESSAGES];
+
+static display_jitter_t jitter = {0};
+static display_radio_stats_t radio_stats = {0};
+// From the SoftDevice radio notifications, see display_radio_notify()
+static volatile bool radio_active = false;
+// A frame is being held back for the radio, since radio_wait_start
+static volatile bool radio_waiting = false;
+static uint64_t radio_wait_start;
+// display_render() is on LANE_LOW; it's only ever queued once
+static volatile bool render_queued = false;
+
+APP_TIMER_DEF(display_state_tmr);
+APP_TIMER_DEF(display_commit_tmr);
+APP_TIMER_DEF(display_cmd_tmr);
+APP_TIMER_DEF(display_save_tmr);
+static display_state_cb_t *state_cb = NULL;
+// Last state loaded from or written to flash
+static display_state_t saved_state = {
+  .brightness = 0xFF,
+};
 // Random data when needed
 static uint8_t random_data[RANDOM_BUF_SZ];
 static uint8_t random_pos = 0;
@@ -79,23 +166,48 @@ void init_led_display(led_display *disp, nrfx_twim_t *twi_instance,
     uint8_t addr) {
   disp->addr = addr & 0x7F;
   disp->twi_instance = twi_instance;
+  for (int i=0; i<NUM_MESSAGES; i++)
+    message_set_text(&message_staging[i], default_text[i]);
+  memcpy(message_set, message_staging, sizeof(message_staging));
   disp->cur_msg_idx = 0;
   disp->cur_message = &message_set[0];
   disp->msg_pos = 0;
   disp->brightness = 0;
+  disp->blink = DISP_BLINK_OFF;
   uint8_t enable = CMD_OSCILLATOR | 1;
   display_i2c_send(disp, &enable, 1);
+  disp->power = DISP_POWER_ON;
 
-  // Setup an app timer to update the display
+  // Setup an app timer to update the display.  It's single shot and
+  // re-armed once each frame is done, so only one update is ever queued no
+  // matter how long the main loop is held up.
   APP_TIMER_DEF(led_display_tmr);
+  disp->timer_id = led_display_tmr;
   APP_ERROR_CHECK(app_timer_create(
-        &led_display_tmr,
-        APP_TIMER_MODE_REPEATED,
+        &disp->timer_id,
+        APP_TIMER_MODE_SINGLE_SHOT,
         display_timer_handler));
-  APP_ERROR_CHECK(app_timer_start(
-        led_display_tmr,
-        APP_TIMER_TICKS(DISP_UPDATE_FREQUENCY_MS),
-        (void *)disp));
+  disp->ticks_rtc = app_timer_cnt_get();
+  disp->ticks = 0;
+  display_restart_phase(disp);
+  display_timer_schedule(disp);
+
+  APP_ERROR_CHECK(app_timer_create(
+        &display_state_tmr,
+        APP_TIMER_MODE_SINGLE_SHOT,
+        display_state_timer_handler));
+  APP_ERROR_CHECK(app_timer_create(
+        &display_commit_tmr,
+        APP_TIMER_MODE_SINGLE_SHOT,
+        display_commit_retry));
+  APP_ERROR_CHECK(app_timer_create(
+        &display_cmd_tmr,
+        APP_TIMER_MODE_SINGLE_SHOT,
+        display_cmd_retry));
+  APP_ERROR_CHECK(app_timer_create(
+        &display_save_tmr,
+        APP_TIMER_MODE_SINGLE_SHOT,
+        display_save_post));
 
   NRF_LOG_INFO("Display setup at 0x%08x", (uint32_t)disp);
 
@@ -106,37 +218,313 @@ void init_led_display(led_display *disp, nrfx_twim_t *twi_instance,
 }
 
 /**
- * Handle the timer
+ * Current time in RTC ticks.  The app timer counter is only 24 bits, so
+ * this has to be called more often than it wraps (512s), which the display
+ * timer takes care of.
+ */
+static uint64_t display_now(led_display *disp) {
+  uint32_t now = app_timer_cnt_get();
+  disp->ticks += app_timer_cnt_diff_compute(now, disp->ticks_rtc);
+  disp->ticks_rtc = now;
+  return disp->ticks;
+}
+
+/**
+ * Frames between two times.  Frames aren't a whole number of ticks, so this
+ * works from the exact ratio and never drifts.
+ */
+static uint32_t display_frames(uint64_t start, uint64_t now) {
+  return (uint32_t)(((now - start) * 1000) /
+      (APP_TIMER_CLOCK_FREQ * DISP_UPDATE_FREQUENCY_MS));
+}
+
+/**
+ * RTC tick at which a frame starts.
+ */
+static uint64_t display_frame_time(uint64_t start, uint32_t frame) {
+  uint64_t num = (uint64_t)frame * APP_TIMER_CLOCK_FREQ *
+    DISP_UPDATE_FREQUENCY_MS;
+  return start + (num + 999) / 1000;
+}
+
+/**
+ * Start the message's animation over from now.
+ */
+static void display_restart_phase(led_display *disp) {
+  disp->msg_start = display_now(disp);
+  disp->msg_pos = 0;
+}
+
+static bool display_wargames_locked(led_display *disp) {
+  return disp->cur_message->update == MSG_WARGAMES &&
+    disp->anim_data.wargames_map == 0xFF;
+}
+
+/**
+ * First frame after pos that changes the picture, or 0 if nothing will.
+ */
+static uint32_t display_next_change(led_display *disp, uint32_t pos) {
+  led_message *msg = disp->cur_message;
+  if (!disp->on || !msg || !msg->speed)
+    return 0;
+  if (display_wargames_locked(disp)) {
+    // The chip blinks on its own; only wake to stop blinking and to unlock
+    if (pos < WARGAMES_HOLD_TIME/2)
+      return WARGAMES_HOLD_TIME/2;
+    return WARGAMES_HOLD_TIME + 1;
+  }
+  return (pos / msg->speed + 1) * msg->speed;
+}
+
+/**
+ * Arm the timer for the next frame that changes what's shown.  Deadlines
+ * are absolute, so time spent drawing or waiting in the scheduler doesn't
+ * push later frames back.
+ */
+static void display_timer_schedule(led_display *disp) {
+  // Nothing to do until it's turned back on
+  if (!disp->on) {
+    app_timer_stop(disp->timer_id);
+    disp->next_frame = 0;
+    disp->deadline = 0;
+    radio_waiting = false;
+    return;
+  }
+
+  uint64_t now = display_now(disp);
+  uint32_t timeout = DISP_IDLE_TICKS;
+
+  disp->deadline = 0;
+  disp->next_frame = display_next_change(
+      disp, display_frames(disp->msg_start, now));
+  if (disp->next_frame) {
+    uint64_t deadline = display_frame_time(disp->msg_start, disp->next_frame);
+    if (deadline < now + APP_TIMER_MIN_TIMEOUT_TICKS) {
+      disp->next_frame = display_next_change(disp, disp->next_frame);
+      deadline = display_frame_time(disp->msg_start, disp->next_frame);
+    }
+    if (deadline - now < DISP_IDLE_TICKS) {
+      disp->deadline = deadline;
+      timeout = deadline - now;
+    }
+  }
+  app_timer_stop(disp->timer_id);
+  APP_ERROR_CHECK(app_timer_start(disp->timer_id, timeout, (void *)disp));
+}
+
+/**
+ * Note how late a frame was.
+ */
+static void display_jitter_record(uint32_t late_ticks) {
+  uint32_t late_ms = (uint32_t)(((uint64_t)late_ticks * 1000) /
+      APP_TIMER_CLOCK_FREQ);
+  if (late_ticks > jitter.max_late_ticks)
+    jitter.max_late_ticks = late_ticks;
+  for (int i=0; i<DISP_JITTER_BUCKETS; i++) {
+    if (late_ms < (1u << i)) {
+      jitter.late[i]++;
+      return;
+    }
+  }
+  jitter.very_late++;
+}
+
+/**
+ * Trace the jitter histogram every so often.
+ */
+static void display_jitter_report(led_display *disp) {
+  static uint64_t last_report = 0;
+  if (disp->ticks - last_report < DISP_JITTER_REPORT_TICKS)
+    return;
+  last_report = disp->ticks;
+  TRACE("Frame jitter <1/<2/<4 ms: %d %d %d",
+      jitter.late[0], jitter.late[1], jitter.late[2]);
+  TRACE("Frame jitter <8/<16/<32 ms: %d %d %d",
+      jitter.late[3], jitter.late[4], jitter.late[5]);
+  TRACE("Frame jitter <64/more: %d %d, max %d ticks",
+      jitter.late[6], jitter.very_late, jitter.max_late_ticks);
+  TRACE("Frames skipped: %d", jitter.skipped);
+  TRACE("Frames deferred for radio: %d, %d forced",
+      radio_stats.deferred, radio_stats.forced);
+  TRACE("Radio wait total %d, max %d ticks",
+      radio_stats.total_wait_ticks, radio_stats.max_wait_ticks);
+}
+
+const display_jitter_t *display_get_jitter() {
+  return &jitter;
+}
+
+const display_radio_stats_t *display_get_radio_stats() {
+  return &radio_stats;
+}
+
+/**
+ * Radio notification, from interrupt context.  active goes true
+ * RADIO_NOTIFICATION_DISTANCE before each radio event and false once it's
+ * over, which is when a held back frame gets drawn.
+ */
+void display_radio_notify(led_display *disp, bool active) {
+  radio_active = active;
+  if (!active && radio_waiting)
+    display_render_post(disp);
+}
+
+/**
+ * Handle the timer.  The message position comes from the RTC rather than
+ * counting calls, so a stalled main loop drops frames instead of slowing
+ * the message down, and a badge left running for days doesn't wrap.
  */
 static void display_timer_handler(void *context) {
   led_display *disp = (led_display *)(context);
   if (!disp)
     return;
-  if (!disp->on)
-    return;
-  if (!disp->cur_message)
-    return;
-  ++disp->msg_pos;
-  uint16_t speed = disp->cur_message->speed;
-  if (speed && (disp->msg_pos % speed == 0)) {
+
+  uint64_t now = display_now(disp);
+  // Woken early if the timer was restarted while this was queued, and
+  // already counted if this is the radio deferral running out
+  if (disp->deadline && now >= disp->deadline && !radio_waiting)
+    display_jitter_record(now - disp->deadline);
+  display_jitter_report(disp);
+
+  led_message *msg = disp->cur_message;
+  uint32_t pos = display_frames(disp->msg_start, now);
+  disp->msg_pos = pos;
+  if (disp->next_frame && pos >= disp->next_frame) {
+    if (!display_wargames_locked(disp))
+      jitter.skipped += (pos - disp->next_frame) / msg->speed;
 #ifdef DISPLAY_DEBUG
     NRF_LOG_INFO("In display_timer_handler, disp: 0x%08x", (uint32_t)disp);
 #endif
-    APP_ERROR_CHECK(app_sched_event_put(
-        (void *)&disp,
-        sizeof(led_display *),
-        display_update_callback));
+    // Drawing is background work; the timer is re-armed once it's done.
+    if (display_render_post(disp))
+      return;
   }
+  display_timer_schedule(disp);
 }
 
-static void display_update_callback(void *event_data, uint16_t event_size) {
-  led_display *disp = *(led_display **)(event_data);
-#ifdef DISPLAY_DEBUG
-  NRF_LOG_INFO("In display_update_callback, disp: 0x%08x", (uint32_t)disp);
-#endif
-  if (!disp)
+/**
+ * Queue display_render() unless it already is.  Safe from interrupts.
+ */
+static bool display_render_post(led_display *disp) {
+  bool queued;
+  CRITICAL_REGION_ENTER();
+  queued = render_queued;
+  render_queued = true;
+  CRITICAL_REGION_EXIT();
+  if (queued)
+    return true;
+  if (lane_put(LANE_LOW, display_render, disp) != NRF_SUCCESS) {
+    render_queued = false;
+    return false;
+  }
+  return true;
+}
+
+static void display_render(void *context) {
+  led_display *disp = (led_display *)context;
+  render_queued = false;
+  if (display_radio_defer(disp))
     return;
   display_update(disp);
+  display_timer_schedule(disp);
+}
+
+/**
+ * Hold a frame back while the radio is busy, so the I2C burst doesn't add
+ * to the radio's peak current or get preempted halfway.  The radio going
+ * idle runs display_render() again; the display timer does after
+ * DISP_RADIO_MAX_DEFER, including when the notification lands between
+ * the check and radio_waiting being set.
+ */
+static bool display_radio_defer(led_display *disp) {
+  uint64_t now = display_now(disp);
+  if (!radio_waiting) {
+    if (!radio_active)
+      return false;
+    radio_wait_start = now;
+    radio_waiting = true;
+    radio_stats.deferred++;
+    app_timer_stop(disp->timer_id);
+    APP_ERROR_CHECK(app_timer_start(
+          disp->timer_id, DISP_RADIO_MAX_DEFER, (void *)disp));
+    return true;
+  }
+  uint32_t waited = (uint32_t)(now - radio_wait_start);
+  // Another radio event started before we got here
+  if (radio_active && waited < DISP_RADIO_MAX_DEFER)
+    return true;
+  radio_waiting = false;
+  if (radio_active)
+    radio_stats.forced++;
+  radio_stats.total_wait_ticks += waited;
+  if (waited > radio_stats.max_wait_ticks)
+    radio_stats.max_wait_ticks = waited;
+  return false;
+}
+
+/**
+ * Pack text into a message, 6 bits a character, first character in the low
+ * bits.  Codes 0-63 are ASCII 0x20-0x5F; 0x60-0x7F fold down onto those, so
+ * lowercase comes out as uppercase, and anything else becomes a space.
+ */
+void message_set_text(led_message *msg, const char *text) {
+  int i;
+  memset(msg->text, 0, sizeof(msg->text));
+  for (i=0; i<MSG_MAX_LEN && text[i]; i++) {
+    uint8_t c = (uint8_t)text[i];
+    if (c >= 0x60 && c < 0x80)
+      c -= 0x20;
+    if (c < 0x20 || c >= 0x60)
+      c = ' ';
+    uint16_t code = (c - 0x20) << ((i * 6) % 8);
+    msg->text[(i * 6) / 8] |= code & 0xFF;
+    if (code >> 8)
+      msg->text[(i * 6) / 8 + 1] |= code >> 8;
+  }
+  msg->len = i;
+}
+
+/**
+ * Character i of a message as ASCII, or 0 past the end.
+ */
+char message_char(const led_message *msg, int i) {
+  if (i < 0 || i >= message_len(msg))
+    return 0;
+  int byte = (i * 6) / 8;
+  uint16_t word = msg->text[byte];
+  if (byte + 1 < MSG_PACKED_LEN)
+    word |= msg->text[byte + 1] << 8;
+  return ((word >> ((i * 6) % 8)) & 0x3F) + 0x20;
+}
+
+/**
+ * Convert a message in the old plain text layout, from flash or an older
+ * app, in place.  The first character used to be where blink is now, and
+ * blink is never more than 3.  Returns true if it was converted.
+ */
+bool message_upgrade(led_message *msg) {
+  if (msg->blink < 0x20)
+    return false;
+  legacy_led_message old;
+  memcpy(&old, msg, sizeof(old));
+  old.message[sizeof(old.message) - 1] = '\0';
+  msg->blink = old.blink & 3;
+  message_set_text(msg, old.message);
+  return true;
+}
+
+static int message_len(const led_message *msg) {
+  return msg->len < MSG_MAX_LEN ? msg->len : MSG_MAX_LEN;
+}
+
+/**
+ * Unpack up to n characters starting at pos.  Returns how many there were.
+ */
+static int message_copy(const led_message *msg, int pos, char *dest, int n) {
+  int i;
+  for (i=0; i<n && pos+i < message_len(msg); i++)
+    dest[i] = message_char(msg, pos+i);
+  return i;
 }
 
 static void display_update(led_display *disp) {
@@ -153,54 +541,53 @@ static void display_update(led_display *disp) {
 
   switch (msg->update) {
     case MSG_STATIC:
-      strncpy(buf, msg->message, LED_DISPLAY_WIDTH);
+      message_copy(msg, 0, buf, LED_DISPLAY_WIDTH);
       display_text(disp, (uint8_t *)buf);
       break;
 
     case MSG_SCROLL:
-      len = strlen(msg->message);
+      len = message_len(msg);
       // len+1 allows screen to go blank in between iterations
       pos = (disp->msg_pos / msg->speed) % (len+1);
-      start = &(msg->message[pos]);
-      strncpy(buf, start, LED_DISPLAY_WIDTH);
+      message_copy(msg, pos, buf, LED_DISPLAY_WIDTH);
       display_text(disp, (uint8_t *)buf);
       break;
 
     case MSG_REPLACE:
-      chunks = strlen(msg->message) / LED_DISPLAY_WIDTH;
+      chunks = message_len(msg) / LED_DISPLAY_WIDTH;
       pos = (disp->msg_pos / msg->speed) % (chunks+1);
-      if (pos < chunks) {
-        start = &(msg->message[pos*LED_DISPLAY_WIDTH]);
-        strncpy(buf, start, LED_DISPLAY_WIDTH);
-      }
+      if (pos < chunks)
+        message_copy(msg, pos*LED_DISPLAY_WIDTH, buf, LED_DISPLAY_WIDTH);
       display_text(disp, (uint8_t *)buf);
       break;
 
     case MSG_WARGAMES:
       if (disp->anim_data.wargames_map == 0xFF) {
-        // We have a lock!
-        pos = disp->msg_pos / (msg->speed * 4);
-        // Reset eventually
-        if (disp->msg_pos > WARGAMES_HOLD_TIME) {
+        // Locked on: the message is already up and blinking in hardware.
+        // Hold it steady for the second half, then start over.
+        if (disp->msg_pos > WARGAMES_HOLD_TIME)
           disp->anim_data.wargames_map = 0;
-        }
-        if ((pos & 1) || (disp->msg_pos > (WARGAMES_HOLD_TIME/2))) {
-          display_text(disp, (uint8_t *)msg->message);
-        } else {
-          display_text(disp, (uint8_t *)buf);
-        }
+        else if (disp->msg_pos >= WARGAMES_HOLD_TIME/2)
+          display_set_blink(disp, DISP_BLINK_OFF);
       } else {
         uint8_t rand = getrandom();
         if (WARGAMES_MATCH(rand)) {
-          NRF_LOG_INFO("Wargames: Matched character!");
+          TRACE("Wargames: Matched character!");
           rand = getrandom();
           disp->anim_data.wargames_map |= (1 << (rand & 0x7));
-          if (disp->anim_data.wargames_map == 0xFF)
-            disp->msg_pos = 0;
+          if (disp->anim_data.wargames_map == 0xFF) {
+            // We have a lock!
+            display_restart_phase(disp);
+            message_copy(msg, 0, buf, LED_DISPLAY_WIDTH);
+            display_text(disp, (uint8_t *)buf);
+            display_set_blink(disp,
+                msg->blink ? msg->blink : WARGAMES_LOCK_BLINK);
+            break;
+          }
         }
         for(int i=0; i<LED_DISPLAY_WIDTH; i++) {
           if (disp->anim_data.wargames_map & (1 << i)) {
-            buf[i] = msg->message[i];
+            buf[i] = message_char(msg, i);
           } else {
             rand = getrandom();
             buf[i] = char_options[rand % 32];
@@ -211,13 +598,11 @@ static void display_update(led_display *disp) {
       break;
 
     case MSG_SCROLL_LOOP:
-      len = strlen(msg->message);
+      len = message_len(msg);
       pos = (disp->msg_pos / msg->speed) %
         (len + sizeof(scroll_loop_separator) - 1);
       if (pos < len) {
-        start = &(msg->message[pos]);
-        strncpy(buf, start, LED_DISPLAY_WIDTH);
-        len = strlen(start);
+        len = message_copy(msg, pos, buf, LED_DISPLAY_WIDTH);
         pos = 0;
       } else {
         pos -= len;
@@ -231,7 +616,7 @@ static void display_update(led_display *disp) {
       }
       // Loop the beginning
       if (len < LED_DISPLAY_WIDTH)
-        strncpy(buf+len, msg->message, LED_DISPLAY_WIDTH - len);
+        message_copy(msg, 0, buf+len, LED_DISPLAY_WIDTH - len);
       display_text(disp, (uint8_t *)buf);
       break;
 
@@ -250,6 +635,9 @@ static inline ret_code_t display_i2c_send(
   do {
     rc = nrfx_twim_tx(disp->twi_instance, disp->addr, data, len, 0);
   } while(rc == NRFX_ERROR_BUSY);
+  // Blocking, so it's on the chip by now
+  if (rc == NRFX_SUCCESS)
+    disp->last_tx_ticks = app_timer_cnt_get();
   return rc;
 }
 
@@ -282,14 +670,78 @@ ret_code_t display_set_brightness(led_display *disp, uint8_t level) {
 }
 
 /**
- * Set on/off and blink
+ * Blank the display and stop the chip's oscillator.  The display timer
+ * stops too (see display_timer_schedule).
+ */
+static ret_code_t display_standby(led_display *disp) {
+  uint8_t cmd = CMD_DISPLAY;
+  ret_code_t rv = display_i2c_send(disp, &cmd, 1);
+  if (rv != NRF_SUCCESS)
+    return rv;
+  cmd = CMD_OSCILLATOR;
+  rv = display_i2c_send(disp, &cmd, 1);
+  if (rv == NRF_SUCCESS)
+    disp->power = DISP_POWER_STANDBY;
+  return rv;
+}
+
+/**
+ * Restart the oscillator and reload display RAM and dimming from our copy,
+ * all before the display is enabled so nothing stale flashes up.
+ */
+static ret_code_t display_wake(led_display *disp) {
+  uint8_t cmd = CMD_OSCILLATOR | 1;
+  ret_code_t rv = display_i2c_send(disp, &cmd, 1);
+  if (rv != NRF_SUCCESS)
+    return rv;
+  // disp->buf still holds the last frame sent
+  disp->buf[0] = CMD_WRITE_RAM;
+  rv = display_i2c_send(disp, disp->buf, 17);
+  if (rv != NRF_SUCCESS)
+    return rv;
+  rv = display_set_brightness(disp, disp->brightness);
+  if (rv != NRF_SUCCESS)
+    return rv;
+  disp->power = DISP_POWER_ON;
+  // The timebase wasn't kept up while off, start it over
+  disp->ticks_rtc = app_timer_cnt_get();
+  display_restart_phase(disp);
+  return NRF_SUCCESS;
+}
+
+/**
+ * Set on/off and blink.  Off puts the chip in standby.
  */
 ret_code_t display_mode(led_display *disp, uint8_t on, uint8_t blink) {
+  ret_code_t rv = NRF_SUCCESS;
   on = on & 1;
-  disp->on = on;
-  blink = (blink & 3) << 1;
-  uint8_t message = CMD_DISPLAY | blink | on;
-  return display_i2c_send(disp, &message, 1);
+  disp->blink = blink & 3;
+  if (!on) {
+    disp->on = 0;
+    if (disp->power == DISP_POWER_ON)
+      rv = display_standby(disp);
+    display_timer_schedule(disp);
+    return rv;
+  }
+  if (disp->power == DISP_POWER_STANDBY) {
+    rv = display_wake(disp);
+    if (rv != NRF_SUCCESS)
+      return rv;
+  }
+  disp->on = 1;
+  uint8_t message = CMD_DISPLAY | (disp->blink << 1) | 1;
+  rv = display_i2c_send(disp, &message, 1);
+  display_timer_schedule(disp);
+  return rv;
+}
+
+/**
+ * Change the blink rate, only talking to the chip if it's different.
+ */
+void display_set_blink(led_display *disp, uint8_t blink) {
+  if ((blink & 3) == disp->blink)
+    return;
+  display_mode(disp, disp->on, blink);
 }
 
 /**
@@ -301,9 +753,12 @@ void display_set_message(led_display *disp, led_message *msg) {
     disp->cur_msg_idx = 0;
   }
   disp->cur_message = msg;
-  disp->msg_pos = 0;
+  display_restart_phase(disp);
   memset((void *)&disp->anim_data.wargames_map, 0, sizeof(disp->anim_data));
+  display_set_blink(disp,
+      msg->update == MSG_WARGAMES ? DISP_BLINK_OFF : msg->blink);
   display_update(disp);
+  display_timer_schedule(disp);
 }
 
 /**
@@ -317,16 +772,19 @@ void display_show_pairing_code(led_display *disp, char *pairing_code) {
   };
   if (!pairing_code) {
     if (old_message) {
+      // The tables may have been swapped in the meantime
       disp->cur_msg_idx = old_msg_idx;
-      display_set_message(disp, old_message);
+      display_set_message(disp, (old_msg_idx >= 0) ?
+          &message_set[old_msg_idx] : old_message);
       old_message = NULL;
     }
     return;
   }
   old_message = disp->cur_message;
   old_msg_idx = disp->cur_msg_idx;
-  memcpy(&pairing_message.message, pairing_code, BLE_GAP_PASSKEY_LEN);
-  pairing_message.message[BLE_GAP_PASSKEY_LEN] = '\0';
+  char text[BLE_GAP_PASSKEY_LEN + 1] = {0};
+  memcpy(text, pairing_code, BLE_GAP_PASSKEY_LEN);
+  message_set_text(&pairing_message, text);
   disp->cur_msg_idx = -1;
   display_set_message(disp, &pairing_message);
 }
@@ -344,6 +802,7 @@ void display_next_message(led_display *disp) {
   if (disp->cur_msg_idx == NUM_MESSAGES)
     disp->cur_msg_idx = 0;
   display_set_message(disp, &message_set[disp->cur_msg_idx]);
+  display_state_changed(disp);
 }
 
 /**
@@ -357,6 +816,7 @@ void display_prev_message(led_display *disp) {
   else
     disp->cur_msg_idx--;
   display_set_message(disp, &message_set[disp->cur_msg_idx]);
+  display_state_changed(disp);
 }
 
 /**
@@ -366,6 +826,7 @@ void display_inc_brightness(led_display *disp) {
   if (disp->brightness == MAX_BRIGHTNESS)
     return;
   display_set_brightness(disp, disp->brightness + 1);
+  display_state_changed(disp);
 }
 
 /**
@@ -375,6 +836,20 @@ void display_dec_brightness(led_display *disp) {
   if (disp->brightness == 0)
     return;
   display_set_brightness(disp, disp->brightness - 1);
+  display_state_changed(disp);
+}
+
+/**
+ * RTC ticks until the next frame is due, or UINT32_MAX if none is, for
+ * fitting long blocking work in between frames.
+ */
+uint32_t display_frame_slack(led_display *disp) {
+  if (!disp->deadline)
+    return UINT32_MAX;
+  uint64_t now = display_now(disp);
+  if (now >= disp->deadline)
+    return 0;
+  return (uint32_t)(disp->deadline - now);
 }
 
 /**
@@ -403,6 +878,32 @@ void display_selftest_next(led_display *disp) {
   display_i2c_send(disp, disp->buf, 17);
 }
 
+/**
+ * Write count frames with every segment lit, reading each back from the
+ * chip's RAM.  Returns the RTC ticks taken; *ok is cleared if a transfer
+ * failed or what came back didn't match.
+ */
+uint32_t display_bench_i2c(led_display *disp, uint8_t count, bool *ok) {
+  uint8_t readback[2*LED_DISPLAY_WIDTH];
+  uint8_t addr = CMD_WRITE_RAM;
+
+  disp->buf[0] = CMD_WRITE_RAM;
+  memset(&disp->buf[1], 0xFF, 2*LED_DISPLAY_WIDTH);
+  *ok = true;
+  uint32_t start = app_timer_cnt_get();
+  for (int i=0; i<count; i++) {
+    if (display_i2c_send(disp, disp->buf, 17) != NRF_SUCCESS ||
+        nrfx_twim_tx(disp->twi_instance, disp->addr, &addr, 1, true) ||
+        nrfx_twim_rx(disp->twi_instance, disp->addr, readback,
+          sizeof(readback)) ||
+        memcmp(readback, &disp->buf[1], sizeof(readback))) {
+      *ok = false;
+      break;
+    }
+  }
+  return app_timer_cnt_diff_compute(app_timer_cnt_get(), start);
+}
+
 /**
  * Load from storage
  */
@@ -410,14 +911,18 @@ ret_code_t display_load_storage() {
   for (uint16_t i=0; i<NUM_MESSAGES; i++) {
     int len = sizeof(led_message);
     ret_code_t rv = get_message(&message_set[i], &len, i);
-    if (rv == NRF_SUCCESS)
+    if (rv == NRF_SUCCESS) {
+      // Rewritten packed the next time it's changed
+      message_upgrade(&message_set[i]);
       continue;
+    }
     // it's fine if they're not found
     if (rv == FDS_ERR_NOT_FOUND)
       // We can't return because there might be gaps!
       continue;
     return rv;
   }
+  memcpy(message_staging, message_set, sizeof(message_staging));
   refresh_crcs();
   return NRF_SUCCESS;
 }
@@ -443,6 +948,113 @@ ret_code_t display_save_storage() {
   return NRF_SUCCESS;
 }
 
+/**
+ * Restore brightness, on/off and the active message from flash.  With
+ * force_on the saved on/off is ignored and the display comes on, so a
+ * button wake doesn't put the chip in standby just to wake it again.
+ */
+ret_code_t display_load_state(led_display *disp, bool force_on) {
+  display_state_t state;
+  int len = sizeof(state);
+  ret_code_t rv = get_display_state(&state, &len);
+  if (rv != NRF_SUCCESS)
+    return rv;
+  if (len != sizeof(state) ||
+      state.brightness > MAX_BRIGHTNESS ||
+      state.msg_idx < 0 || state.msg_idx >= NUM_MESSAGES)
+    return NRF_ERROR_INVALID_DATA;
+  saved_state = state;
+  display_set_brightness(disp, state.brightness);
+  display_mode(disp, force_on ? 1 : state.on, disp->blink);
+  disp->cur_msg_idx = state.msg_idx;
+  display_set_message(disp, &message_set[state.msg_idx]);
+  display_state_publish(disp);
+  return NRF_SUCCESS;
+}
+
+/**
+ * Note a change to the runtime state.  The save is pushed back on every
+ * change, so a burst of adjustments ends up as one write.
+ */
+void display_state_changed(led_display *disp) {
+  display_state_publish(disp);
+  app_timer_stop(display_state_tmr);
+  APP_ERROR_CHECK(app_timer_start(
+        display_state_tmr, DISPLAY_STATE_SAVE_DELAY, (void *)disp));
+}
+
+void display_set_state_cb(display_state_cb_t *cb) {
+  state_cb = cb;
+}
+
+static void display_state_publish(led_display *disp) {
+  if (state_cb)
+    state_cb(disp);
+}
+
+/**
+ * Save the runtime state if it's settled somewhere new.
+ */
+static void display_state_timer_handler(void *context) {
+  if (lane_put(LANE_LOW, display_state_save, context) != NRF_SUCCESS)
+    APP_ERROR_CHECK(app_timer_start(
+          display_state_tmr, DISPLAY_STATE_RETRY, context));
+}
+
+static void display_state_save(void *context) {
+  display_state_write((led_display *)context);
+}
+
+static ret_code_t display_state_write(led_display *disp) {
+  // FDS writes from this after we return
+  static display_state_t state;
+
+  state.brightness = disp->brightness & MAX_BRIGHTNESS;
+  state.on = disp->on;
+  // Keep the saved index while showing a pairing code or the like
+  state.msg_idx = (disp->cur_msg_idx < 0) ?
+    saved_state.msg_idx : disp->cur_msg_idx;
+  state.reserved = 0;
+  if (!memcmp(&state, &saved_state, sizeof(state)))
+    return NRF_SUCCESS;
+  NRF_LOG_INFO("Saving display state.");
+  ret_code_t rv = save_display_state(&state, sizeof(state));
+  if (rv == NRF_SUCCESS)
+    saved_state = state;
+  return rv;
+}
+
+/**
+ * Replace the messages and runtime state together, for a config bundle.
+ * As with display_commit_messages() flash must be idle when this swaps
+ * tables.  Only messages and state that changed are saved.
+ */
+ret_code_t display_apply_config(led_display *disp,
+    const led_message *messages, const display_state_t *state) {
+  led_message *next = (message_set == message_tables[0]) ?
+    message_tables[1] : message_tables[0];
+  memcpy(next, messages, sizeof(message_staging));
+  for (int i=0; i<NUM_MESSAGES; i++)
+    message_upgrade(&next[i]);
+  message_set = next;
+  CRITICAL_REGION_ENTER();
+  memcpy(message_staging, next, sizeof(message_staging));
+  CRITICAL_REGION_EXIT();
+
+  display_set_brightness(disp, state->brightness);
+  display_mode(disp, state->on & 1, disp->blink);
+  disp->cur_msg_idx = state->msg_idx;
+  display_set_message(disp, &message_set[state->msg_idx]);
+  display_state_publish(disp);
+  // Saved below instead
+  app_timer_stop(display_state_tmr);
+
+  ret_code_t rv = display_save_storage();
+  if (rv != NRF_SUCCESS)
+    return rv;
+  return display_state_write(disp);
+}
+
 /**
  * Update the CRCs for the messages.
  */
@@ -489,3 +1101,161 @@ static void cook_random() {
     random_data[i] ^= sauce;
   sauce = (sauce << 1) | (sauce >> 7);
 }
+
+/**
+ * Queue a display change.  Safe from interrupts: nothing touches the
+ * display or I2C until the main loop applies it, in order with everything
+ * else posted.
+ */
+static ret_code_t display_cmd_put(led_display *disp, const display_cmd_t *cmd) {
+  ret_code_t rv = NRF_SUCCESS;
+  bool start = false;
+
+  CRITICAL_REGION_ENTER();
+  if (cmd_queue.count == DISPLAY_CMD_QUEUE_SIZE) {
+    rv = NRF_ERROR_NO_MEM;
+  } else {
+    cmd_queue.cmds[(cmd_queue.head + cmd_queue.count) %
+      DISPLAY_CMD_QUEUE_SIZE] = *cmd;
+    cmd_queue.count++;
+    start = !cmd_queue.queued;
+    cmd_queue.queued = true;
+  }
+  CRITICAL_REGION_EXIT();
+
+  if (rv != NRF_SUCCESS) {
+    TRACE("Display command %d dropped", cmd->type);
+    return rv;
+  }
+  // The command is queued either way; if the lane is full, leave queued set
+  // so nothing else tries and post the run again shortly
+  if (start && lane_put(LANE_HIGH, display_cmd_run, disp) != NRF_SUCCESS)
+    APP_ERROR_CHECK(app_timer_start(display_cmd_tmr, DISPLAY_CMD_RETRY, disp));
+  return NRF_SUCCESS;
+}
+
+ret_code_t display_post(
+    led_display *disp, display_cmd_type_t type, uint8_t value) {
+  display_cmd_t cmd = {
+    .type = type,
+    .value = value,
+  };
+  return display_cmd_put(disp, &cmd);
+}
+
+ret_code_t display_post_pairing_code(led_display *disp, const char *code) {
+  display_cmd_t cmd = {
+    .type = DISP_CMD_PAIRING_CODE,
+  };
+  memcpy(cmd.code, code, BLE_GAP_PASSKEY_LEN);
+  return display_cmd_put(disp, &cmd);
+}
+
+/**
+ * Apply everything posted so far, from the high priority lane.
+ */
+static void display_cmd_run(void *context) {
+  led_display *disp = (led_display *)context;
+  display_cmd_t cmd;
+  char code[BLE_GAP_PASSKEY_LEN + 1] = {0};
+
+  while (1) {
+    bool found = false;
+    CRITICAL_REGION_ENTER();
+    if (cmd_queue.count) {
+      cmd = cmd_queue.cmds[cmd_queue.head];
+      cmd_queue.head = (cmd_queue.head + 1) % DISPLAY_CMD_QUEUE_SIZE;
+      cmd_queue.count--;
+      found = true;
+    } else {
+      cmd_queue.queued = false;
+    }
+    CRITICAL_REGION_EXIT();
+    if (!found)
+      return;
+
+    switch (cmd.type) {
+      case DISP_CMD_MODE:
+        display_mode(disp, cmd.value & 1, disp->blink);
+        display_state_changed(disp);
+        break;
+      case DISP_CMD_BRIGHTNESS:
+        display_set_brightness(disp, cmd.value);
+        display_state_changed(disp);
+        break;
+      case DISP_CMD_SELECT:
+        if (cmd.value >= NUM_MESSAGES)
+          break;
+        disp->cur_msg_idx = cmd.value;
+        display_set_message(disp, &message_set[cmd.value]);
+        display_state_changed(disp);
+        break;
+      case DISP_CMD_MESSAGES:
+        display_commit_messages(disp);
+        break;
+      case DISP_CMD_PAIRING_CODE:
+        memcpy(code, cmd.code, BLE_GAP_PASSKEY_LEN);
+        display_show_pairing_code(disp, code);
+        break;
+      case DISP_CMD_PAIRING_DONE:
+        display_show_pairing_code(disp, NULL);
+        break;
+    }
+  }
+}
+
+/**
+ * Swap in everything written to message_staging.  The table being reused
+ * was live before the last swap and FDS may still be writing from it, so
+ * hold off until flash is idle.
+ */
+static void display_commit_messages(led_display *disp) {
+  if (storage_is_busy()) {
+    app_timer_stop(display_commit_tmr);
+    APP_ERROR_CHECK(app_timer_start(
+          display_commit_tmr, DISPLAY_COMMIT_RETRY, (void *)disp));
+    return;
+  }
+  led_message *next = (message_set == message_tables[0]) ?
+    message_tables[1] : message_tables[0];
+  CRITICAL_REGION_ENTER();
+  memcpy(next, message_staging, sizeof(message_staging));
+  // Older apps still write plain text.  Put the packed form back so reads
+  // and further partial writes start from it.
+  for (int i=0; i<NUM_MESSAGES; i++)
+    if (message_upgrade(&next[i]))
+      memcpy(&message_staging[i], &next[i], sizeof(led_message));
+  CRITICAL_REGION_EXIT();
+  message_set = next;
+  TRACE("Messages committed");
+  // Start the current one over in case it's what changed
+  if (disp->cur_msg_idx >= 0)
+    display_set_message(disp, &message_set[disp->cur_msg_idx]);
+  display_save_post(NULL);
+}
+
+static void display_cmd_retry(void *context) {
+  if (lane_put(LANE_HIGH, display_cmd_run, context) != NRF_SUCCESS)
+    APP_ERROR_CHECK(app_timer_start(display_cmd_tmr, DISPLAY_CMD_RETRY, context));
+}
+
+static void display_commit_retry(void *context) {
+  if (display_post((led_display *)context, DISP_CMD_MESSAGES, 0) != NRF_SUCCESS)
+    APP_ERROR_CHECK(app_timer_start(
+          display_commit_tmr, DISPLAY_COMMIT_RETRY, context));
+}
+
+/**
+ * Queue the save on LANE_LOW, trying again shortly if it's full.
+ */
+static void display_save_post(void *unused) {
+  if (lane_put(LANE_LOW, display_save_messages, NULL) == NRF_SUCCESS)
+    return;
+  app_timer_stop(display_save_tmr);
+  APP_ERROR_CHECK(app_timer_start(
+        display_save_tmr, DISPLAY_COMMIT_RETRY, NULL));
+}
+
+static void display_save_messages(void *unused) {
+  display_save_storage();
+}
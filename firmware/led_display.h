@@ -1,6 +1,7 @@
 #ifndef _LED_DISPLAY_H_
 #define _LED_DISPLAY_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "nrfx_twim.h"
@@ -15,12 +16,31 @@
 
 #define MAX_BRIGHTNESS 15
 
-#define MSG_MAX_LEN 35  // One extra byte is reserved for null
+// Message text is packed 6 bits a character, see message_set_text()
+#define MSG_MAX_LEN 46
+#define MSG_PACKED_LEN ((MSG_MAX_LEN * 6 + 7) / 8)
 
 #define SCROLL_LOOP_SEPARATOR "       "
 
 #define NUM_MESSAGES 4
 
+// Runtime state is saved once it's been left alone this long
+#define DISPLAY_STATE_SAVE_DELAY APP_TIMER_TICKS(5000)
+// Try the save again this soon if LANE_LOW was full
+#define DISPLAY_STATE_RETRY APP_TIMER_TICKS(20)
+
+// Whether the HT16K33 oscillator is running
+typedef enum {
+  DISP_POWER_STANDBY,
+  DISP_POWER_ON,
+} __attribute__ ((packed)) display_power_t;
+
+// HT16K33 blink rates
+#define DISP_BLINK_OFF      0
+#define DISP_BLINK_2HZ      1
+#define DISP_BLINK_1HZ      2
+#define DISP_BLINK_HALF_HZ  3
+
 typedef enum {
   MSG_STATIC,
   MSG_SCROLL,
@@ -34,10 +54,67 @@ typedef struct _led_message {
   message_update_t update;
   // How often this message updates
   uint16_t speed;
-  // Contents of message
-  char message[MSG_MAX_LEN+1];
+  // Hardware blink rate, DISP_BLINK_*.  For MSG_WARGAMES, the rate while
+  // locked on (DISP_BLINK_OFF means the default).
+  uint8_t blink;
+  // Characters in text
+  uint8_t len;
+  // Contents of message, packed
+  uint8_t text[MSG_PACKED_LEN];
 } __attribute__ ((packed, aligned(4))) led_message;
 
+// Lateness of display frames, bucket i counts frames less than 2^i ms late
+#define DISP_JITTER_BUCKETS 7
+
+typedef struct {
+  uint32_t late[DISP_JITTER_BUCKETS];
+  // Frames more than 2^(DISP_JITTER_BUCKETS-1) ms late
+  uint32_t very_late;
+  uint32_t max_late_ticks;
+  // Frames skipped because we were too late to draw them
+  uint32_t skipped;
+} display_jitter_t;
+
+// Longest a frame is held back for the radio before it's sent anyway.  A
+// connection event (NRF_SDH_BLE_GAP_EVENT_LENGTH) plus the notification
+// distance fits inside it.
+#define DISP_RADIO_MAX_DEFER APP_TIMER_TICKS(12)
+
+typedef struct {
+  // Frames held back because the radio was about to run
+  uint32_t deferred;
+  // Frames sent after DISP_RADIO_MAX_DEFER with the radio still busy
+  uint32_t forced;
+  // RTC ticks deferred frames spent waiting
+  uint32_t total_wait_ticks;
+  uint32_t max_wait_ticks;
+} display_radio_stats_t;
+
+// Changes to the display from outside the main loop, see display_post()
+typedef enum {
+  DISP_CMD_MODE,          // value: on/off
+  DISP_CMD_BRIGHTNESS,    // value: level
+  DISP_CMD_SELECT,        // value: message index
+  DISP_CMD_MESSAGES,      // Commit message_staging, written over BLE
+  DISP_CMD_PAIRING_CODE,  // Show a passkey, see display_post_pairing_code()
+  DISP_CMD_PAIRING_DONE,  // Put back whatever the passkey replaced
+} display_cmd_type_t;
+
+#define DISPLAY_CMD_QUEUE_SIZE 8
+// How long to wait for room on LANE_HIGH to run queued commands
+#define DISPLAY_CMD_RETRY APP_TIMER_TICKS(5)
+// How long to wait for flash, or room on LANE_LOW, before trying a message
+// commit or save again
+#define DISPLAY_COMMIT_RETRY APP_TIMER_TICKS(20)
+
+// Runtime state kept across reboots, one flash word
+typedef struct {
+  uint8_t brightness;
+  uint8_t on;
+  int8_t msg_idx;
+  uint8_t reserved;
+} __attribute__ ((packed, aligned(4))) display_state_t;
+
 typedef struct _led_display {
   // TWI instance to use
   nrfx_twim_t *twi_instance;
@@ -47,12 +124,25 @@ typedef struct _led_display {
   uint8_t addr;
   // Is display on
   uint8_t on;
+  // Chip power state, standby whenever the display is off
+  display_power_t power;
+  // Hardware blink rate
+  uint8_t blink;
   // Brightness
   uint8_t brightness;
   // Currently displayed message
   led_message *cur_message;
-  // Message position
-  uint16_t msg_pos;
+  // Message position, in DISP_UPDATE_FREQUENCY_MS frames
+  uint32_t msg_pos;
+  // RTC ticks when the message started
+  uint64_t msg_start;
+  // RTC ticks, extended from the 24 bit counter
+  uint64_t ticks;
+  uint32_t ticks_rtc;
+  // Next frame that changes the picture, or 0 if none will
+  uint32_t next_frame;
+  // When next_frame is due, if the timer is armed for it, else 0
+  uint64_t deadline;
   // Current message index, or -1 for special messages
   int8_t cur_msg_idx;
   // Animation data
@@ -61,18 +151,29 @@ typedef struct _led_display {
   } anim_data;
   // Timer ID
   app_timer_id_t timer_id;
+  // RTC ticks when the last I2C transfer finished
+  uint32_t last_tx_ticks;
 } led_display;
 
+// Called from the main loop when brightness, on/off or the index changes
+typedef void display_state_cb_t(led_display *disp);
+
 extern uint16_t fontmap[128];
-extern led_message message_set[NUM_MESSAGES];
+// Live messages, and the copy BLE writes into until they're committed
+extern led_message *message_set;
+extern led_message message_staging[NUM_MESSAGES];
 
 void init_led_display(led_display *disp, nrfx_twim_t *twi_instance,
     uint8_t addr);
+void message_set_text(led_message *msg, const char *text);
+char message_char(const led_message *msg, int i);
+bool message_upgrade(led_message *msg);
 ret_code_t display_text(led_display *disp, uint8_t *text);
 ret_code_t display_set_brightness(led_display *disp, uint8_t level);
 ret_code_t display_mode(led_display *disp, uint8_t on, uint8_t blink);
-#define display_on(disp) display_mode((disp), 1, 0)
-#define display_off(disp) display_mode((disp), 0, 0)
+#define display_on(disp) display_mode((disp), 1, (disp)->blink)
+#define display_off(disp) display_mode((disp), 0, (disp)->blink)
+void display_set_blink(led_display *disp, uint8_t blink);
 void display_set_message(led_display *disp, led_message *msg);
 void display_show_pairing_code(led_display *disp, char *pairing_code);
 void display_next_message(led_display *disp);
@@ -80,7 +181,20 @@ void display_prev_message(led_display *disp);
 void display_inc_brightness(led_display *disp);
 void display_dec_brightness(led_display *disp);
 void display_selftest_next(led_display *disp);
+uint32_t display_bench_i2c(led_display *disp, uint8_t count, bool *ok);
+uint32_t display_frame_slack(led_display *disp);
+const display_jitter_t *display_get_jitter();
+const display_radio_stats_t *display_get_radio_stats();
+void display_radio_notify(led_display *disp, bool active);
 ret_code_t display_load_storage();
 ret_code_t display_save_storage();
+ret_code_t display_load_state(led_display *disp, bool force_on);
+void display_state_changed(led_display *disp);
+void display_set_state_cb(display_state_cb_t *cb);
+ret_code_t display_apply_config(led_display *disp,
+    const led_message *messages, const display_state_t *state);
+ret_code_t display_post(
+    led_display *disp, display_cmd_type_t type, uint8_t value);
+ret_code_t display_post_pairing_code(led_display *disp, const char *code);
 
 #endif /* _LED_DISPLAY_H_ */
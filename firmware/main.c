@@ -15,10 +15,12 @@
 #include "nrfx_gpiote.h"
 
 #include "ble_manager.h"
+#include "boot.h"
 #include "buttons.h"
+#include "lanes.h"
 #include "led_display.h"
-#include "selftest.h"
-#include "storage.h"
+#include "power.h"
+#include "trace.h"
 
 #ifndef NRFX_TWIM0_ENABLED
 # error TWIM0 is not enabled.
@@ -41,6 +43,14 @@
 # define PIN_SDA 27
 #endif
 
+#define SCHED_MAX_EVENT_DATA_SIZE 32
+// Check the "high water" traces before changing this
+#define SCHED_QUEUE_SIZE 16
+// A GC page erase holds the CPU for a few frames.  Leave it until the
+// joystick has been left alone this long, rather than while someone's
+// watching the badge respond.
+#define GC_IDLE_AFTER_MIN 1
+
 led_display display = {0};
 
 static inline void log_init(void) {
@@ -65,8 +75,27 @@ static inline void twi_init(nrfx_twim_t *master) {
 }
 
 static inline void scheduler_init() {
-  // SWAG numbers
-  APP_SCHED_INIT(32, 16);
+  APP_SCHED_INIT(SCHED_MAX_EVENT_DATA_SIZE, SCHED_QUEUE_SIZE);
+}
+
+/**
+ * Trace new high water marks for the scheduler and timer queues, so they
+ * can be sized from what the badge actually does.
+ */
+static void queue_watermarks() {
+  static uint16_t sched_max = 0;
+  static uint8_t timer_op_max = 0;
+  uint16_t sched = app_sched_queue_utilization_get();
+  uint8_t timer_op = app_timer_op_queue_utilization_get();
+  if (sched > sched_max) {
+    sched_max = sched;
+    TRACE("Scheduler queue high water: %d of %d", sched, SCHED_QUEUE_SIZE);
+  }
+  if (timer_op > timer_op_max) {
+    timer_op_max = timer_op;
+    TRACE("Timer op queue high water: %d of %d",
+        timer_op, APP_TIMER_CONFIG_OP_QUEUE_SIZE);
+  }
 }
 
 static inline void timer_init() {
@@ -84,11 +113,47 @@ static inline void crypto_init() {
   nrf_crypto_rng_init(NULL, NULL);
 }
 
+/**
+ * What's going on that flash GC shouldn't interrupt.
+ */
+static uint8_t storage_busy() {
+  uint8_t busy = 0;
+  if (ble_manager_is_connected())
+    busy |= STORAGE_BUSY_CONNECTION;
+  if (power_idle_minutes() < GC_IDLE_AFTER_MIN)
+    busy |= STORAGE_BUSY_INPUT;
+  return busy;
+}
+
+/**
+ * Check for a reset request held on the joystick at power on.
+ *  CENTER: wipe everything
+ *  UP: wipe messages, keep bonds
+ *  DOWN: wipe bonds, keep messages
+ */
+static storage_erase_t reset_request() {
+  if (is_center_pushed())
+    return STORAGE_ERASE_ALL;
+  int pushed = get_buttons_pushed();
+  if (pushed & (1 << JOYSTICK_UP))
+    return STORAGE_ERASE_MESSAGES;
+  if (pushed & (1 << JOYSTICK_DOWN))
+    return STORAGE_ERASE_BONDS;
+  return 0;
+}
+
+/**
+ * LEFT held at power on runs the selftest, e.g. for factory QA.
+ */
+static bool selftest_request() {
+  return (get_buttons_pushed() & (1 << JOYSTICK_LEFT)) != 0;
+}
+
 int main(void) {
-  bool need_selftest = false;
   nrfx_twim_t twi_master = NRFX_TWIM_INSTANCE(0);
 
   log_init();
+  trace_init();
 
   NRF_LOG_INFO("----Restart----");
   NRF_LOG_INFO("Initialized logging.");
@@ -96,47 +161,49 @@ int main(void) {
   scheduler_init();
   timer_init();
   power_management_init();
+  power_init(&display);
   twi_init(&twi_master);
   gpio_init();
-  storage_init();
   crypto_init();
+  boot_mark(BOOT_STAGE_CORE);
 
   NRF_LOG_INFO("Setting up display.");
 
   init_led_display(&display, &twi_master, 0x70);
-  display_on(&display);
   display_set_brightness(&display, 8);
+  if (power_woke_from_off()) {
+    boot_show_resume(&display);
+  } else {
+    display_on(&display);
+    boot_show_animation(&display);
+  }
 
   NRF_LOG_INFO("Setting up buttons.");
   buttons_init(&display);
-  if (is_center_pushed()) {
-    NRF_LOG_INFO("Resetting device!");
-    storage_erase_all();
-    NRF_LOG_INFO("Done!");
-    need_selftest = true;
-  }
-
-  need_selftest = need_selftest || storage_check_firstboot();
-
-  if (need_selftest) {
-    run_selftest(&display);
-    storage_finish_firstboot();
-  }
+  buttons_set_ble_accept_callback(ble_match_request_respond);
 
-  // Deferred until after possible reset
-  display_load_storage();
-  display_set_message(&display, NULL);
+  storage_gc_init(storage_busy);
 
-  NRF_LOG_INFO("Setting up BLE.");
-  ble_stack_init(&display);
-  buttons_set_ble_accept_callback(ble_match_request_respond);
+  // Storage, BLE and the stored messages come up asynchronously from here.
+  // The button that woke us is probably still held, don't take it as a
+  // reset request.
+  if (power_woke_from_off())
+    boot_start(&display, 0, false);
+  else
+    boot_start(&display, reset_request(), selftest_request());
 
   NRF_LOG_INFO("Entering main loop...");
 
   while (1) {
     app_sched_execute();
+    lanes_execute();
     ble_main();
-    if (!NRF_LOG_PROCESS())
+    if (lanes_pending())
+      continue;
+    if (!NRF_LOG_PROCESS()) {
+      queue_watermarks();
+      trace_flush();
       nrf_pwr_mgmt_run();
+    }
   }
 }
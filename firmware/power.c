@@ -0,0 +1,119 @@
+/**
+ * Deep sleep.
+ *
+ * Once the badge has been left alone with the display off for
+ * POWER_SLEEP_MIN minutes it goes to System OFF, to be woken by the
+ * joystick.  Waking is a reset; boot checks power_woke_from_off() to skip
+ * the boot animation and factory reset check and get the display back up.
+ */
+
+#include "power.h"
+
+#include "app_timer.h"
+#include "nrf.h"
+#include "nrf_gpio.h"
+#include "nrf_log.h"
+#include "nrf_pwr_mgmt.h"
+
+#include "ble_manager.h"
+#include "buttons.h"
+#include "storage.h"
+
+static void power_timer_handler(void *context);
+static bool power_shutdown_handler(nrf_pwr_mgmt_evt_t event);
+
+APP_TIMER_DEF(power_tmr);
+static led_display *display = NULL;
+// Minutes without anything happening
+static volatile uint16_t idle_minutes = 0;
+static bool woke_from_off = false;
+
+static const uint8_t wake_pins[] = {
+  JOYSTICK_CENTER,
+  JOYSTICK_UP,
+  JOYSTICK_LEFT,
+  JOYSTICK_RIGHT,
+  JOYSTICK_DOWN,
+};
+
+NRF_PWR_MGMT_HANDLER_REGISTER(power_shutdown_handler, 0);
+
+/**
+ * Must be called before the SoftDevice is enabled, while the reset reason
+ * is still readable directly.
+ */
+void power_init(led_display *disp) {
+  display = disp;
+  woke_from_off = (NRF_POWER->RESETREAS & POWER_RESETREAS_OFF_Msk) != 0;
+  // Reset reasons stick until cleared
+  NRF_POWER->RESETREAS = NRF_POWER->RESETREAS;
+  if (woke_from_off)
+    NRF_LOG_INFO("Woke from System OFF.");
+
+  APP_ERROR_CHECK(app_timer_create(
+        &power_tmr,
+        APP_TIMER_MODE_REPEATED,
+        power_timer_handler));
+  APP_ERROR_CHECK(app_timer_start(power_tmr, POWER_CHECK_INTERVAL, NULL));
+}
+
+/**
+ * Note that somebody's using the badge.  Safe from interrupts.
+ */
+void power_activity(void) {
+  idle_minutes = 0;
+}
+
+bool power_woke_from_off(void) {
+  return woke_from_off;
+}
+
+/**
+ * Minutes since the last button press or connection.
+ */
+uint16_t power_idle_minutes(void) {
+  return idle_minutes;
+}
+
+static void power_timer_handler(void *context) {
+  if (ble_manager_is_connected()) {
+    idle_minutes = 0;
+    return;
+  }
+  if (idle_minutes < UINT16_MAX)
+    idle_minutes++;
+
+#if POWER_DISPLAY_TIMEOUT_MIN
+  if (display->on && idle_minutes >= POWER_DISPLAY_TIMEOUT_MIN) {
+    NRF_LOG_INFO("Display timed out.");
+    display_off(display);
+    idle_minutes = 0;
+    return;
+  }
+#endif
+
+  if (!display->on && idle_minutes >= POWER_SLEEP_MIN) {
+    NRF_LOG_INFO("Idle for %d minutes, going to sleep.", idle_minutes);
+    nrf_pwr_mgmt_shutdown(NRF_PWR_MGMT_SHUTDOWN_GOTO_SYSOFF);
+  }
+}
+
+/**
+ * Get ready for System OFF.  Holding off while flash is busy makes pwr_mgmt
+ * try again a second later.
+ */
+static bool power_shutdown_handler(nrf_pwr_mgmt_evt_t event) {
+  if (event != NRF_PWR_MGMT_EVT_PREPARE_SYSOFF)
+    return true;
+  if (storage_is_busy())
+    return false;
+
+  // The HT16K33 keeps its RAM in standby, so the last frame is still there
+  // to show straight away on wake.
+  display_off(display);
+  buttons_disable();
+  for (int i=0; i<sizeof(wake_pins); i++)
+    nrf_gpio_cfg_sense_input(
+        wake_pins[i], NRF_GPIO_PIN_PULLUP, NRF_GPIO_PIN_SENSE_LOW);
+  return true;
+}
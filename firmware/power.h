@@ -0,0 +1,22 @@
+#ifndef _POWER_H_
+#define _POWER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "led_display.h"
+
+// Go to System OFF after this long with the display off, nobody connected
+// and no buttons pressed
+#define POWER_SLEEP_MIN           5
+// Turn the display off after this long without input, 0 to never
+#define POWER_DISPLAY_TIMEOUT_MIN 0
+
+#define POWER_CHECK_INTERVAL      APP_TIMER_TICKS(60000)
+
+void power_init(led_display *disp);
+void power_activity(void);
+bool power_woke_from_off(void);
+uint16_t power_idle_minutes(void);
+
+#endif /* _POWER_H_ */
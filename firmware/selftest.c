@@ -1,81 +1,311 @@
+/**
+ * Selftest, run on first boot or with LEFT held at power on.
+ *
+ * A state machine stepped by an app_timer, so BLE and everything else keep
+ * running.  The measurements come first and need no one watching; after
+ * that the segments walk until a button is pressed, then each direction is
+ * asked for in turn.  Results go to the log and the selftest
+ * characteristic.
+ */
+
 #include <string.h>
 
-#include "nrf_delay.h"
+#include "app_scheduler.h"
+#include "app_timer.h"
+#include "nrf_crypto.h"
 #include "nrf_log.h"
 
 #include "buttons.h"
 #include "selftest.h"
+#include "storage.h"
+#include "trace.h"
+
+#define SELFTEST_TICK         APP_TIMER_TICKS(50)
+// Ticks per segment step, and to leave PASS up
+#define SEGMENT_STEP_TICKS    2
+#define PASS_HOLD_TICKS       20
+// Give up on FDS after this many ticks
+#define FLASH_TIMEOUT_TICKS   60
+
+#define I2C_FRAMES            8
+#define RNG_CHUNKS            8
+#define RNG_CHUNK_SIZE        16
+#define LOOP_SAMPLES          16
+
+#define TICKS_TO_US(t) \
+  ((uint32_t)(((uint64_t)(t) * 1000000) / APP_TIMER_CLOCK_FREQ))
+
+typedef enum {
+  STEP_I2C,
+  STEP_RNG,
+  STEP_LOOP,
+  STEP_FLASH,
+  STEP_FLASH_WAIT,
+  STEP_SEGMENTS,
+  STEP_BUTTONS,
+  STEP_PASS,
+} selftest_step_t;
 
 typedef struct {
   int button_id;
   char *name;
 } button_info;
 
-void run_selftest(led_display *disp) {
+static void selftest_tick(void *context);
+static bool selftest_step();
+static void selftest_loop_probe(void *p_event_data, uint16_t event_size);
+static void selftest_flash_done();
+static void selftest_report();
+static void selftest_fail();
+static void selftest_show(led_message *msg, const char *text);
+
+static const button_info buttons[] = {
+  {JOYSTICK_CENTER, "CENTER"},
+  {JOYSTICK_UP, "UP"},
+  {JOYSTICK_LEFT, "LEFT"},
+  {JOYSTICK_RIGHT, "RIGHT"},
+  {JOYSTICK_DOWN, "DOWN"},
+};
+
+APP_TIMER_DEF(selftest_tmr);
+static led_display *display = NULL;
+static selftest_callback_t *done_callback = NULL;
+static selftest_results_t results = {0};
+
+static selftest_step_t step;
+static uint16_t step_ticks;
+static uint8_t step_count;
+// Hold the current step until all buttons are released
+static bool wait_clear;
+static uint32_t loop_total_ticks;
+static volatile bool flash_done;
+static storage_bench_t flash_bench;
+static led_message message = {
+  .update = MSG_STATIC,
+};
+
+/**
+ * Start the selftest.  Returns straight away; done_cb is called from the
+ * main loop if everything passes.  On failure FAIL stays up and done_cb is
+ * never called, so the firstboot flag stays clear and it runs again.
+ */
+void selftest_start(led_display *disp, selftest_callback_t *done_cb) {
+  static bool timer_created = false;
   NRF_LOG_INFO("Starting selftest.");
+  display = disp;
+  done_callback = done_cb;
+  memset(&results, 0, sizeof(results));
+  results.status = SELFTEST_RUNNING;
+  step = STEP_I2C;
+  step_ticks = 0;
+  step_count = 0;
+  wait_clear = false;
   joystick_set_selftest(true);
-  if (get_buttons_pushed()) {
-    NRF_LOG_INFO("Waiting for button clear.");
-    while (get_buttons_pushed());
-  }
-  while (!get_buttons_pushed()) {
-    display_selftest_next(disp);
-    nrf_delay_ms(250);
-  }
-  if (get_buttons_pushed()) {
-    NRF_LOG_INFO("Waiting for button clear.");
-    while (get_buttons_pushed());
+  // Nothing else draws while we're using the display.
+  display->cur_msg_idx = -1;
+  display->cur_message = NULL;
+  display_on(display);
+
+  if (!timer_created) {
+    APP_ERROR_CHECK(app_timer_create(
+          &selftest_tmr,
+          APP_TIMER_MODE_SINGLE_SHOT,
+          selftest_tick));
+    timer_created = true;
   }
-  button_info buttons[] = {
-    {
-      JOYSTICK_CENTER,
-      "CENTER"
-    },
-    {
-      JOYSTICK_UP,
-      "UP",
-    },
-    {
-      JOYSTICK_LEFT,
-      "LEFT",
-    },
-    {
-      JOYSTICK_RIGHT,
-      "RIGHT",
-    },
-    {
-      JOYSTICK_DOWN,
-      "DOWN"
+  APP_ERROR_CHECK(app_timer_start(selftest_tmr, SELFTEST_TICK, NULL));
+}
+
+const selftest_results_t *selftest_get_results() {
+  return &results;
+}
+
+static void selftest_tick(void *context) {
+  if (wait_clear) {
+    if (get_buttons_pushed()) {
+      APP_ERROR_CHECK(app_timer_start(selftest_tmr, SELFTEST_TICK, NULL));
+      return;
     }
-  };
-  for (int i=0; i<ARRAY_SIZE(buttons); i++) {
-    led_message lm = {
-      .update = MSG_STATIC
-    };
-    strcpy(lm.message, buttons[i].name);
-    display_set_message(disp, &lm);
-    int pressed;
-    while((pressed = get_buttons_pushed()) == 0)
-      continue;
-    if (pressed != (1 << buttons[i].button_id)) {
-      NRF_LOG_INFO("SELFTEST FAILED");
-      led_message fail = {
-        .update = MSG_STATIC,
-        .message = "FAIL"
-      };
-      display_set_message(disp, &fail);
-      //busy loop forever!
-      while(1);
+    wait_clear = false;
+  }
+  step_ticks++;
+  if (selftest_step())
+    APP_ERROR_CHECK(app_timer_start(selftest_tmr, SELFTEST_TICK, NULL));
+}
+
+/**
+ * Do a little of the current step.  Returns false once there's nothing
+ * more to do.
+ */
+static bool selftest_step() {
+  bool ok;
+  int pressed;
+
+  switch (step) {
+    case STEP_I2C:
+      results.i2c_us = TICKS_TO_US(
+          display_bench_i2c(display, I2C_FRAMES, &ok)) / I2C_FRAMES;
+      if (!ok) {
+        selftest_fail();
+        return false;
+      }
+      step = STEP_RNG;
+      step_count = 0;
+      loop_total_ticks = 0;
+      return true;
+
+    case STEP_RNG: {
+      // A chunk a tick keeps each blocking call short
+      uint8_t chunk[RNG_CHUNK_SIZE];
+      uint32_t start = app_timer_cnt_get();
+      if (nrf_crypto_rng_vector_generate(chunk, sizeof(chunk))) {
+        selftest_fail();
+        return false;
+      }
+      loop_total_ticks += app_timer_cnt_diff_compute(
+          app_timer_cnt_get(), start);
+      if (++step_count < RNG_CHUNKS)
+        return true;
+      if (loop_total_ticks)
+        results.rng_bytes_per_sec = (uint32_t)(
+            ((uint64_t)RNG_CHUNKS * RNG_CHUNK_SIZE * APP_TIMER_CLOCK_FREQ) /
+            loop_total_ticks);
+      step = STEP_LOOP;
+      step_count = 0;
+      loop_total_ticks = 0;
+      return true;
     }
-    while (get_buttons_pushed());
+
+    case STEP_LOOP:
+      if (step_count < LOOP_SAMPLES) {
+        uint32_t now = app_timer_cnt_get();
+        APP_ERROR_CHECK(app_sched_event_put(
+              &now, sizeof(now), selftest_loop_probe));
+        return true;
+      }
+      results.loop_mean_us = TICKS_TO_US(loop_total_ticks) / LOOP_SAMPLES;
+      step = STEP_FLASH;
+      return true;
+
+    case STEP_FLASH:
+      flash_done = false;
+      if (storage_bench_start(&flash_bench, selftest_flash_done)) {
+        selftest_fail();
+        return false;
+      }
+      step = STEP_FLASH_WAIT;
+      step_ticks = 0;
+      return true;
+
+    case STEP_FLASH_WAIT:
+      if (!flash_done) {
+        if (step_ticks < FLASH_TIMEOUT_TICKS)
+          return true;
+        selftest_fail();
+        return false;
+      }
+      results.flash_write_us = TICKS_TO_US(flash_bench.write_ticks);
+      results.flash_read_us =
+        TICKS_TO_US(flash_bench.read_ticks) / STORAGE_BENCH_READS;
+      if (!flash_bench.ok) {
+        selftest_fail();
+        return false;
+      }
+      selftest_report();
+      step = STEP_SEGMENTS;
+      step_ticks = 0;
+      wait_clear = true;
+      return true;
+
+    case STEP_SEGMENTS:
+      if (get_buttons_pushed()) {
+        step = STEP_BUTTONS;
+        step_count = 0;
+        selftest_show(&message, buttons[0].name);
+        wait_clear = true;
+        return true;
+      }
+      if (step_ticks % SEGMENT_STEP_TICKS == 0)
+        display_selftest_next(display);
+      return true;
+
+    case STEP_BUTTONS:
+      if ((pressed = get_buttons_pushed()) == 0)
+        return true;
+      if (pressed != (1 << buttons[step_count].button_id)) {
+        selftest_fail();
+        return false;
+      }
+      wait_clear = true;
+      if (++step_count < ARRAY_SIZE(buttons)) {
+        selftest_show(&message, buttons[step_count].name);
+        return true;
+      }
+      NRF_LOG_INFO("SELFTEST PASSED.");
+      results.status = SELFTEST_PASSED;
+      selftest_show(&message, "PASS");
+      step = STEP_PASS;
+      step_ticks = 0;
+      return true;
+
+    case STEP_PASS:
+      if (step_ticks < PASS_HOLD_TICKS)
+        return true;
+      joystick_set_selftest(false);
+      if (done_callback)
+        done_callback();
+      return false;
   }
-  NRF_LOG_INFO("SELFTEST PASSED.");
-  led_message pass = {
-    .update = MSG_STATIC,
-    .message = "PASS"
-  };
-  display_set_message(disp, &pass);
-  nrf_delay_ms(1000);
-  joystick_set_selftest(false);
-  return;
+  return false;
+}
+
+/**
+ * Time from being queued to running, i.e. how long the main loop takes to
+ * get round to scheduler work.
+ */
+static void selftest_loop_probe(void *p_event_data, uint16_t event_size) {
+  uint32_t queued = *(uint32_t *)p_event_data;
+  uint32_t ticks = app_timer_cnt_diff_compute(app_timer_cnt_get(), queued);
+  uint32_t us = TICKS_TO_US(ticks);
+  loop_total_ticks += ticks;
+  if (us > results.loop_max_us)
+    results.loop_max_us = us;
+  step_count++;
+}
+
+/**
+ * FDS callback, may be in interrupt context.
+ */
+static void selftest_flash_done() {
+  flash_done = true;
+}
+
+static void selftest_report() {
+  NRF_LOG_INFO("Selftest measurements:");
+  NRF_LOG_INFO("  I2C frame write+read: %d us", results.i2c_us);
+  NRF_LOG_INFO("  RNG: %d bytes/s", results.rng_bytes_per_sec);
+  NRF_LOG_INFO("  Main loop latency: %d us mean, %d us max",
+      results.loop_mean_us, results.loop_max_us);
+  NRF_LOG_INFO("  Flash %d byte record: write %d us, read %d us",
+      STORAGE_BENCH_WORDS * 4, results.flash_write_us,
+      results.flash_read_us);
+  TRACE("Selftest i2c %d us rng %d B/s", results.i2c_us,
+      results.rng_bytes_per_sec);
+  TRACE("Selftest loop %d/%d us", results.loop_mean_us, results.loop_max_us);
+  TRACE("Selftest flash w %d r %d us", results.flash_write_us,
+      results.flash_read_us);
+}
+
+static void selftest_fail() {
+  NRF_LOG_INFO("SELFTEST FAILED at step %d", step);
+  results.status = SELFTEST_FAILED;
+  results.failed_step = step;
+  if (step <= STEP_FLASH_WAIT)
+    selftest_report();
+  selftest_show(&message, "FAIL");
+}
+
+static void selftest_show(led_message *msg, const char *text) {
+  message_set_text(msg, text);
+  display_set_message(display, msg);
 }
@@ -1,8 +1,37 @@
 #ifndef _SELFTEST_H_
 #define _SELFTEST_H_
 
+#include <stdint.h>
+
 #include "led_display.h"
 
-void run_selftest(led_display *disp);
+typedef enum {
+  SELFTEST_NOT_RUN,
+  SELFTEST_RUNNING,
+  SELFTEST_PASSED,
+  SELFTEST_FAILED,
+} selftest_status_t;
+
+// Step results, also readable over BLE
+typedef struct {
+  uint32_t status;
+  // Step that failed, if any
+  uint32_t failed_step;
+  // Mean time to write a full frame and read it back
+  uint32_t i2c_us;
+  // One STORAGE_BENCH_WORDS record, from queueing to FDS_EVT_WRITE
+  uint32_t flash_write_us;
+  // Opening, checking and closing that record
+  uint32_t flash_read_us;
+  uint32_t rng_bytes_per_sec;
+  // From app_sched_event_put() to the handler running
+  uint32_t loop_mean_us;
+  uint32_t loop_max_us;
+} selftest_results_t;
+
+typedef void selftest_callback_t(void);
+
+void selftest_start(led_display *disp, selftest_callback_t *done_cb);
+const selftest_results_t *selftest_get_results();
 
 #endif // _SELFTEST_H_
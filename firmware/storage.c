@@ -3,18 +3,76 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "app_timer.h"
+#include "lanes.h"
 #include "nrf_log.h"
 
-#define FILE_MAX 0xFFFF
+// Leave a slot in the FDS queue for the peer manager
+#define ERASE_BATCH_SIZE (FDS_OP_QUEUE_SIZE - 1)
+
+// How often to look for a quiet moment to GC
+#define GC_POLL_INTERVAL APP_TIMER_TICKS(1000)
+// Collect when idle once there are this many dirty records
+#define GC_DIRTY_RECORDS 10
+// Below this much contiguous free space (in words), stop waiting for the
+// badge to be left alone
+#define GC_HEADROOM_LOW_WORDS (FDS_VIRTUAL_PAGE_SIZE / 4)
+
+typedef enum {
+  STORAGE_GC_NONE,
+  // Worth doing when nothing else is going on
+  STORAGE_GC_IDLE,
+  // Running short of space, do it as soon as there's no connection
+  STORAGE_GC_LOW_SPACE,
+} storage_gc_urgency_t;
 
 static void storage_evt_handler(const fds_evt_t * const p_evt);
 static ret_code_t storage_get(void *dest, int *len, const uint16_t file, const uint16_t record);
 static ret_code_t storage_save(void *src, const int len, const uint16_t file, const uint16_t record_key);
-static ret_code_t maybe_gc(bool force);
-static bool storage_erase_next(bool init);
-
-static volatile int storage_init_done = 0;
-static volatile bool in_erase = false;
+static void storage_gc_schedule();
+static void storage_gc_start();
+static void storage_gc_run(void *unused);
+static storage_gc_urgency_t storage_gc_urgency();
+static void storage_gc_poll(void *context);
+static bool storage_erase_wanted(fds_record_desc_t *desc);
+static void storage_erase_next();
+static void storage_bench_written(ret_code_t result);
+
+static storage_callback_t *init_done_cb = NULL;
+
+APP_TIMER_DEF(gc_timer);
+static storage_busy_check_t *gc_busy_cb = NULL;
+static volatile bool gc_polling = false;
+static volatile bool gc_running = false;
+static storage_gc_stats_t gc_stats = {0};
+// Our own writes/updates queued in FDS and not yet completed
+static volatile uint8_t writes_pending = 0;
+
+// State for an in-progress flash benchmark
+static struct {
+  storage_bench_t *result;
+  storage_callback_t *done_cb;
+  uint32_t start_ticks;
+  fds_record_desc_t desc;
+} bench;
+static uint32_t bench_data[STORAGE_BENCH_WORDS];
+
+// State for an in-progress erase
+static struct {
+  volatile bool active;
+  storage_erase_t what;
+  fds_find_token_t token;
+  // Record that could not be queued yet
+  fds_record_desc_t desc;
+  bool have_retry;
+  // Deletes queued but not yet completed
+  uint8_t pending;
+  bool scan_done;
+  bool gc_started;
+  uint16_t deleted;
+  uint32_t start_ticks;
+  storage_callback_t *done_cb;
+} erase_state;
 
 #ifdef STORAGE_DEBUG
 # define S_DBG NRF_LOG_INFO
@@ -22,18 +80,29 @@ static volatile bool in_erase = false;
 # define S_DBG(...)
 #endif
 
-void storage_init() {
+/**
+ * Start FDS.  done_cb is called (possibly from interrupt context) once FDS
+ * is ready for use.
+ */
+void storage_init(storage_callback_t *done_cb) {
+  init_done_cb = done_cb;
   fds_register(storage_evt_handler);
   NRF_LOG_INFO("Initializing FDS...");
   APP_ERROR_CHECK(fds_init());
-  while(!storage_init_done);
-  NRF_LOG_INFO("FDS initialized.");
 }
 
-void storage_erase_all() {
-  in_erase = true;
-  storage_erase_next(true);
-  while(in_erase);
+/**
+ * Erase the selected record types from FDS.  done_cb is called (possibly
+ * from interrupt context) once the deletes and the following GC have
+ * finished.
+ */
+void storage_erase(storage_erase_t what, storage_callback_t *done_cb) {
+  memset(&erase_state, 0, sizeof(erase_state));
+  erase_state.what = what;
+  erase_state.done_cb = done_cb;
+  erase_state.start_ticks = app_timer_cnt_get();
+  erase_state.active = true;
+  storage_erase_next();
 }
 
 bool storage_check_firstboot() {
@@ -47,66 +116,137 @@ bool storage_check_firstboot() {
 }
 
 void storage_finish_firstboot() {
-  int flag = FIRSTBOOT_MAGIC;
+  // FDS writes from this after we return
+  static int flag = FIRSTBOOT_MAGIC;
   storage_save(
       &flag, sizeof(flag), FILE_ID_METADATA, RECORD_ID_FIRSTBOOT);
 }
 
-// Returns true so long as more are to be done
-static bool storage_erase_next(bool init) {
-  static uint16_t file;
-  ret_code_t rv = NRF_SUCCESS;
+/**
+ * Check if a record belongs to one of the types being erased.
+ */
+static bool storage_erase_wanted(fds_record_desc_t *desc) {
+  if (erase_state.what == STORAGE_ERASE_ALL)
+    return true;
 
-  if (init)
-    file = 0;
+  fds_flash_record_t flash_record;
+  if (fds_record_open(desc, &flash_record) != FDS_SUCCESS)
+    return false;
+  uint16_t file = flash_record.p_header->file_id;
+  fds_record_close(desc);
+
+  storage_erase_t type;
+  if (file == FILE_ID_MESSAGES)
+    type = STORAGE_ERASE_MESSAGES;
+  else if (file == FILE_ID_METADATA)
+    type = STORAGE_ERASE_METADATA;
+  else if (file >= FILE_ID_PEER_MANAGER_FIRST)
+    type = STORAGE_ERASE_BONDS;
+  else
+    return false;
+  return (erase_state.what & type) != 0;
+}
 
-  for (;file < FILE_MAX;file++) {
-    fds_record_desc_t desc;
-    fds_find_token_t token={0};
-    do {
-      // Loop over all records in the file
-      rv = fds_record_find_in_file(file, &desc, &token);
-      if (rv != FDS_SUCCESS)
+/**
+ * Walk the records that actually exist and queue deletes for the wanted
+ * ones, at most ERASE_BATCH_SIZE in flight at a time.  Once the walk is
+ * done and all deletes have completed, start a single GC.
+ */
+static void storage_erase_next() {
+  while (!erase_state.scan_done && erase_state.pending < ERASE_BATCH_SIZE) {
+    if (!erase_state.have_retry) {
+      if (fds_record_iterate(&erase_state.desc, &erase_state.token)
+          != FDS_SUCCESS) {
+        erase_state.scan_done = true;
         break;
-
-      rv = fds_file_delete(file);
-      if (rv == FDS_ERR_NO_SPACE_IN_QUEUES)
-        return true;
-    } while(1);
+      }
+      if (!storage_erase_wanted(&erase_state.desc))
+        continue;
+    }
+    ret_code_t rv = fds_record_delete(&erase_state.desc);
+    if (rv == FDS_ERR_NO_SPACE_IN_QUEUES) {
+      // Someone else is using the queue; retry on the next FDS event.
+      erase_state.have_retry = true;
+      return;
+    }
+    erase_state.have_retry = false;
+    if (rv != FDS_SUCCESS) {
+      NRF_LOG_ERROR("Erase: delete failed: %d", rv);
+      continue;
+    }
+    erase_state.pending++;
+    erase_state.deleted++;
   }
 
-  return false;
+  if (erase_state.pending || erase_state.gc_started)
+    return;
+  S_DBG("Done erasing %d records, starting gc.", erase_state.deleted);
+  erase_state.gc_started = true;
+  fds_gc();
 }
 
 static void storage_evt_handler(const fds_evt_t * const p_fds_evt) {
+  // Every completed operation frees a queue slot for the next erase batch.
+  if (erase_state.active && !erase_state.gc_started &&
+      p_fds_evt->id != FDS_EVT_INIT) {
+    if (p_fds_evt->id == FDS_EVT_DEL_RECORD && erase_state.pending)
+      erase_state.pending--;
+    storage_erase_next();
+  }
+
   switch (p_fds_evt->id) {
     case FDS_EVT_INIT:
-      S_DBG("Storage init done.");
-      storage_init_done = 1;
+      if (p_fds_evt->result != FDS_SUCCESS) {
+        NRF_LOG_ERROR("FDS init failed: %d", p_fds_evt->result);
+      } else {
+        S_DBG("Storage init done.");
+      }
+      // FDS_EVT_INIT is repeated for every fds_init() caller (e.g. the
+      // peer manager), so only report the first one.
+      if (init_done_cb) {
+        storage_callback_t *cb = init_done_cb;
+        init_done_cb = NULL;
+        cb();
+      }
       break;
     case FDS_EVT_WRITE:
     case FDS_EVT_UPDATE:
+      if (p_fds_evt->write.file_id < FILE_ID_PEER_MANAGER_FIRST &&
+          writes_pending)
+        __atomic_sub_fetch(&writes_pending, 1, __ATOMIC_RELAXED);
+      if (bench.done_cb &&
+          p_fds_evt->write.file_id == FILE_ID_METADATA &&
+          p_fds_evt->write.record_key == RECORD_ID_SELFTEST)
+        storage_bench_written(p_fds_evt->result);
       if (p_fds_evt->result != FDS_SUCCESS) {
         NRF_LOG_ERROR("Write/updated failed!");
       } else {
         S_DBG("Write/update succeeded.");
       }
       if (p_fds_evt->result == FDS_ERR_NO_SPACE_IN_FLASH) {
-        fds_gc();
+        storage_gc_emergency();
       } else {
-        maybe_gc(false);
+        storage_gc_schedule();
       }
       break;
+    case FDS_EVT_DEL_RECORD:
     case FDS_EVT_DEL_FILE:
-      if (in_erase && !storage_erase_next(false)) {
-        S_DBG("Done erasing, starting gc.");
-        fds_gc();
-      }
+      storage_gc_schedule();
       break;
     case FDS_EVT_GC:
-      if (in_erase) {
-        S_DBG("Erase finished.");
-        in_erase = false;
+      if (gc_running) {
+        gc_running = false;
+        storage_gc_log_stats();
+      }
+      if (erase_state.active && erase_state.gc_started) {
+        uint32_t ticks = app_timer_cnt_diff_compute(
+            app_timer_cnt_get(), erase_state.start_ticks);
+        NRF_LOG_INFO("Erased %d records in %d ms.",
+            erase_state.deleted,
+            (uint32_t)(((uint64_t)ticks * 1000) / APP_TIMER_CLOCK_FREQ));
+        erase_state.active = false;
+        if (erase_state.done_cb)
+          erase_state.done_cb();
       }
       break;
     default:
@@ -173,6 +313,22 @@ ret_code_t save_device_name(void *src, const int len) {
   return storage_save(src, len, FILE_ID_METADATA, RECORD_ID_DEVICE_NAME);
 }
 
+ret_code_t get_db_hash(void *dest, int *len) {
+  return storage_get(dest, len, FILE_ID_METADATA, RECORD_ID_DB_HASH);
+}
+
+ret_code_t save_db_hash(void *src, const int len) {
+  return storage_save(src, len, FILE_ID_METADATA, RECORD_ID_DB_HASH);
+}
+
+ret_code_t get_display_state(void *dest, int *len) {
+  return storage_get(dest, len, FILE_ID_METADATA, RECORD_ID_DISPLAY_STATE);
+}
+
+ret_code_t save_display_state(void *src, const int len) {
+  return storage_save(src, len, FILE_ID_METADATA, RECORD_ID_DISPLAY_STATE);
+}
+
 static ret_code_t storage_save(void *src, const int len, const uint16_t file, const uint16_t record_key) {
   if (src == NULL) {
     return NRF_ERROR_INVALID_PARAM;
@@ -208,21 +364,206 @@ static ret_code_t storage_save(void *src, const int len, const uint16_t file, co
     S_DBG("Performing update.");
     rv = fds_record_update(&record_desc, &record);
   }
-  if (rv != FDS_SUCCESS) {
+  if (rv == FDS_SUCCESS) {
+    __atomic_add_fetch(&writes_pending, 1, __ATOMIC_RELAXED);
+  } else if (rv == FDS_ERR_NO_SPACE_IN_FLASH) {
+    storage_gc_emergency();
+  } else {
     S_DBG("Write failed: %d", rv);
   }
   return rv;
 }
 
-static ret_code_t maybe_gc(bool force) {
-  fds_stat_t stats;
-  ret_code_t rv = fds_stat(&stats);
-  if (rv != FDS_SUCCESS)
+/**
+ * True while flash has work outstanding that losing power would break: a
+ * queued write, a GC or an erase.
+ */
+bool storage_is_busy() {
+  return writes_pending || gc_running || erase_state.active;
+}
+
+/**
+ * Time writing, reading back and deleting a STORAGE_BENCH_WORDS record.
+ * done_cb is called once result is filled in, possibly from interrupt
+ * context.
+ */
+ret_code_t storage_bench_start(
+    storage_bench_t *result, storage_callback_t *done_cb) {
+  if (bench.done_cb)
+    return NRF_ERROR_BUSY;
+  for (int i=0; i<STORAGE_BENCH_WORDS; i++)
+    bench_data[i] = 0x5a5a0000 | i;
+  fds_record_t record = {
+    .file_id = FILE_ID_METADATA,
+    .key = RECORD_ID_SELFTEST,
+    .data = {
+      .p_data = bench_data,
+      .length_words = STORAGE_BENCH_WORDS,
+    },
+  };
+  memset(result, 0, sizeof(*result));
+  bench.result = result;
+  bench.done_cb = done_cb;
+  bench.start_ticks = app_timer_cnt_get();
+  ret_code_t rv = fds_record_write(&bench.desc, &record);
+  if (rv != FDS_SUCCESS) {
+    bench.done_cb = NULL;
     return rv;
-  bool must_gc = force || stats.corruption;
-  must_gc = must_gc || (stats.dirty_records > 10);
-  if (must_gc) {
-    return fds_gc();
   }
-  return FDS_SUCCESS;
+  __atomic_add_fetch(&writes_pending, 1, __ATOMIC_RELAXED);
+  return NRF_SUCCESS;
+}
+
+static void storage_bench_written(ret_code_t result) {
+  storage_bench_t *r = bench.result;
+  storage_callback_t *cb = bench.done_cb;
+  r->write_ticks = app_timer_cnt_diff_compute(
+      app_timer_cnt_get(), bench.start_ticks);
+  r->ok = result == FDS_SUCCESS;
+
+  uint32_t start = app_timer_cnt_get();
+  for (int i=0; r->ok && i<STORAGE_BENCH_READS; i++) {
+    fds_flash_record_t flash_record;
+    if (fds_record_open(&bench.desc, &flash_record) != FDS_SUCCESS) {
+      r->ok = false;
+      break;
+    }
+    r->ok = flash_record.p_header->length_words == STORAGE_BENCH_WORDS &&
+      memcmp(flash_record.p_data, bench_data, sizeof(bench_data)) == 0;
+    fds_record_close(&bench.desc);
+  }
+  r->read_ticks = app_timer_cnt_diff_compute(app_timer_cnt_get(), start);
+
+  if (result == FDS_SUCCESS)
+    fds_record_delete(&bench.desc);
+  bench.done_cb = NULL;
+  cb();
+}
+
+/**
+ * Set up the GC scheduler.  busy_cb reports what is currently going on that
+ * a GC page erase would interfere with.
+ */
+void storage_gc_init(storage_busy_check_t *busy_cb) {
+  gc_busy_cb = busy_cb;
+  gc_stats.min_largest_contig = UINT16_MAX;
+  APP_ERROR_CHECK(app_timer_create(
+        &gc_timer,
+        APP_TIMER_MODE_REPEATED,
+        storage_gc_poll));
+}
+
+/**
+ * Note that flash has gotten dirtier, and start polling for a good time to
+ * collect.
+ */
+static void storage_gc_schedule() {
+  if (gc_polling || gc_busy_cb == NULL)
+    return;
+  if (app_timer_start(gc_timer, GC_POLL_INTERVAL, NULL) == NRF_SUCCESS)
+    gc_polling = true;
+}
+
+/**
+ * Collect right now, no matter what else is going on.  Only for when flash
+ * is actually full.
+ */
+void storage_gc_emergency() {
+  NRF_LOG_WARNING("Flash full, emergency GC.");
+  gc_stats.gc_emergency++;
+  storage_gc_start();
+}
+
+static void storage_gc_run(void *unused) {
+  storage_gc_start();
+}
+
+static void storage_gc_start() {
+  if (gc_running)
+    return;
+  if (fds_gc() == FDS_SUCCESS) {
+    gc_running = true;
+    gc_stats.gc_runs++;
+  }
+}
+
+/**
+ * Work out how badly a GC is needed from the current FDS stats.
+ */
+static storage_gc_urgency_t storage_gc_urgency() {
+  fds_stat_t stats;
+  if (fds_stat(&stats) != FDS_SUCCESS)
+    return STORAGE_GC_NONE;
+
+  gc_stats.last = stats;
+  if (stats.largest_contig < gc_stats.min_largest_contig)
+    gc_stats.min_largest_contig = stats.largest_contig;
+  if (stats.dirty_records > gc_stats.max_dirty_records)
+    gc_stats.max_dirty_records = stats.dirty_records;
+  if (stats.words_used > gc_stats.max_words_used)
+    gc_stats.max_words_used = stats.words_used;
+
+  if (stats.corruption)
+    return STORAGE_GC_LOW_SPACE;
+  if (!stats.freeable_words)
+    return STORAGE_GC_NONE;
+  if (stats.largest_contig < GC_HEADROOM_LOW_WORDS)
+    return STORAGE_GC_LOW_SPACE;
+  if (stats.dirty_records > GC_DIRTY_RECORDS)
+    return STORAGE_GC_IDLE;
+  return STORAGE_GC_NONE;
+}
+
+/**
+ * Timer callback: run a pending GC if the badge is quiet enough for it.
+ */
+static void storage_gc_poll(void *context) {
+  if (gc_running || erase_state.active)
+    return;
+
+  storage_gc_urgency_t urgency = storage_gc_urgency();
+  uint8_t busy = gc_busy_cb();
+  bool run;
+  switch (urgency) {
+    case STORAGE_GC_IDLE:
+      run = (busy == 0);
+      break;
+    case STORAGE_GC_LOW_SPACE:
+      // Don't wait for the badge to be left alone, but still stay off the
+      // radio.
+      run = !(busy & STORAGE_BUSY_CONNECTION);
+      break;
+    default:
+      run = false;
+      break;
+  }
+
+  if (urgency != STORAGE_GC_NONE && !run) {
+    gc_stats.gc_deferred++;
+    return;
+  }
+
+  if (run) {
+    S_DBG("Idle GC, urgency %d.", urgency);
+    // Lane full: keep polling and try again next time
+    if (lane_put(LANE_LOW, storage_gc_run, NULL) != NRF_SUCCESS)
+      return;
+  }
+  app_timer_stop(gc_timer);
+  gc_polling = false;
+}
+
+const storage_gc_stats_t *storage_gc_get_stats() {
+  return &gc_stats;
+}
+
+/**
+ * Dump GC stats, for tuning FDS_VIRTUAL_PAGES.
+ */
+void storage_gc_log_stats() {
+  NRF_LOG_INFO("GC: runs=%d emergency=%d deferred=%d",
+      gc_stats.gc_runs, gc_stats.gc_emergency, gc_stats.gc_deferred);
+  NRF_LOG_INFO("GC: min_contig=%d max_dirty=%d max_used=%d (words)",
+      gc_stats.min_largest_contig, gc_stats.max_dirty_records,
+      gc_stats.max_words_used);
 }
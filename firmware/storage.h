@@ -9,18 +9,77 @@
 #define FILE_ID_METADATA          0x0001
 #define RECORD_ID_DEVICE_NAME     0x0001
 #define RECORD_ID_FIRSTBOOT       0x0002
+#define RECORD_ID_DISPLAY_STATE   0x0003
+#define RECORD_ID_SELFTEST        0x0004
+#define RECORD_ID_DB_HASH         0x0005
 
 #define FILE_ID_MESSAGES          0x0002
 #define RECORD_ID_MESSAGE_BASE    0x0001
 
+// The peer manager owns file IDs from here up (PDS_FIRST_RESERVED_FILE_ID)
+#define FILE_ID_PEER_MANAGER_FIRST 0xC000
+
 #define FIRSTBOOT_MAGIC           0xfadec0de
 
 #ifdef DEBUG
 #define STORAGE_DEBUG
 #endif
 
-void storage_init();
-void storage_erase_all();
+// Called once an asynchronous storage operation has completed
+typedef void storage_callback_t(void);
+
+// Record types that can be erased
+typedef enum {
+  STORAGE_ERASE_MESSAGES  = (1 << 0),
+  STORAGE_ERASE_METADATA  = (1 << 1),
+  STORAGE_ERASE_BONDS     = (1 << 2),
+  STORAGE_ERASE_ALL       = 0x7,
+} storage_erase_t;
+
+// Things a GC page erase would get in the way of
+#define STORAGE_BUSY_CONNECTION   (1 << 0)
+#define STORAGE_BUSY_INPUT        (1 << 1)
+
+// Returns a mask of STORAGE_BUSY_* flags
+typedef uint8_t storage_busy_check_t(void);
+
+typedef struct {
+  // GCs started, and how many of those were emergencies
+  uint16_t gc_runs;
+  uint16_t gc_emergency;
+  // Polls where a GC was wanted but the badge was busy
+  uint16_t gc_deferred;
+  // Low/high water marks, in words
+  uint16_t min_largest_contig;
+  uint16_t max_dirty_records;
+  uint16_t max_words_used;
+  // Most recent fds_stat() result
+  fds_stat_t last;
+} storage_gc_stats_t;
+
+// Selftest flash benchmark: one record written, read back and deleted
+#define STORAGE_BENCH_WORDS 64
+#define STORAGE_BENCH_READS 8
+
+typedef struct {
+  // RTC ticks from queueing the write to FDS_EVT_WRITE
+  uint32_t write_ticks;
+  // RTC ticks for all STORAGE_BENCH_READS open/check/close passes
+  uint32_t read_ticks;
+  // Everything read back matched
+  bool ok;
+} storage_bench_t;
+
+void storage_init(storage_callback_t *done_cb);
+void storage_erase(storage_erase_t what, storage_callback_t *done_cb);
+#define storage_erase_all(cb) storage_erase(STORAGE_ERASE_ALL, (cb))
+void storage_gc_init(storage_busy_check_t *busy_cb);
+void storage_gc_emergency();
+const storage_gc_stats_t *storage_gc_get_stats();
+void storage_gc_log_stats();
+bool storage_is_busy();
+ret_code_t storage_bench_start(
+    storage_bench_t *result, storage_callback_t *done_cb);
 bool storage_check_firstboot();
 void storage_finish_firstboot();
 
@@ -36,4 +95,12 @@ ret_code_t save_device_name(void *src, const int len);
 // Save message to flash
 ret_code_t save_message(void *src, const int len, uint16_t id);
 
+// Load/save the attribute table hash from the last boot
+ret_code_t get_db_hash(void *dest, int *len);
+ret_code_t save_db_hash(void *src, const int len);
+
+// Load/save brightness, on/off and index
+ret_code_t get_display_state(void *dest, int *len);
+ret_code_t save_display_state(void *src, const int len);
+
 #endif /* _STORAGE_H_ */
@@ -0,0 +1,90 @@
+#include "trace.h"
+
+#include <stdarg.h>
+#include <stdint.h>
+
+#include "sdk_config.h"
+#include "app_timer.h"
+#include "SEGGER_RTT.h"
+
+#if SEGGER_RTT_CONFIG_MAX_NUM_UP_BUFFERS <= TRACE_RTT_CHANNEL
+# error Trace needs its own RTT up buffer.
+#endif
+
+#if (TRACE_RING_SIZE & (TRACE_RING_SIZE - 1))
+# error TRACE_RING_SIZE must be a power of 2.
+#endif
+
+static trace_record_t trace_ring[TRACE_RING_SIZE];
+// Free running; the slot is the low bits
+static volatile uint32_t trace_head = 0;
+static volatile uint32_t trace_tail = 0;
+static volatile uint32_t trace_dropped = 0;
+
+static uint8_t trace_rtt_buf[TRACE_RTT_BUF_SIZE];
+
+void trace_init(void) {
+  SEGGER_RTT_ConfigUpBuffer(
+      TRACE_RTT_CHANNEL,
+      "Trace",
+      trace_rtt_buf,
+      sizeof(trace_rtt_buf),
+      SEGGER_RTT_MODE_NO_BLOCK_SKIP);
+}
+
+/**
+ * Add a record to the ring.  Use TRACE() rather than calling this directly.
+ */
+void trace_write(uint16_t fmt_id, uint8_t nargs, ...) {
+  // Claim a slot.  Whoever is preempted here just tries again.
+  uint32_t pos = trace_head;
+  do {
+    if (pos - trace_tail >= TRACE_RING_SIZE) {
+      __atomic_fetch_add(&trace_dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(&trace_head, &pos, pos + 1,
+        true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+  trace_record_t *rec = &trace_ring[pos & (TRACE_RING_SIZE - 1)];
+  rec->fmt_id = fmt_id;
+  rec->nargs = nargs;
+  rec->ticks = app_timer_cnt_get();
+  va_list ap;
+  va_start(ap, nargs);
+  for (uint8_t i=0; i<TRACE_MAX_ARGS; i++)
+    rec->args[i] = (i < nargs) ? va_arg(ap, uint32_t) : 0;
+  va_end(ap);
+  __atomic_store_n(&rec->ready, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Send finished records out over RTT.  Only called from the idle loop; if
+ * nobody is reading RTT, records stay put until the ring fills.
+ */
+void trace_flush(void) {
+  while (trace_tail != trace_head) {
+    trace_record_t *rec = &trace_ring[trace_tail & (TRACE_RING_SIZE - 1)];
+    // Still being written by whoever we interrupted
+    if (!__atomic_load_n(&rec->ready, __ATOMIC_ACQUIRE))
+      return;
+    if (!SEGGER_RTT_Write(TRACE_RTT_CHANNEL, rec, sizeof(*rec)))
+      return;
+    rec->ready = 0;
+    __atomic_store_n(&trace_tail, trace_tail + 1, __ATOMIC_RELEASE);
+  }
+
+  uint32_t dropped = trace_dropped;
+  if (dropped) {
+    trace_record_t rec = {
+      .fmt_id = TRACE_FMT_DROPPED,
+      .nargs = 1,
+      .ready = 1,
+      .ticks = app_timer_cnt_get(),
+      .args = {dropped},
+    };
+    if (!SEGGER_RTT_Write(TRACE_RTT_CHANNEL, &rec, sizeof(rec)))
+      return;
+    __atomic_fetch_sub(&trace_dropped, dropped, __ATOMIC_RELAXED);
+  }
+}
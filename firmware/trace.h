@@ -0,0 +1,55 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Binary trace log.
+ *
+ * TRACE() stores a fixed size record with the format string's ID and up to
+ * TRACE_MAX_ARGS integer arguments, and is safe from any interrupt level.
+ * Nothing is formatted on the badge: trace_flush() sends raw records out on
+ * an RTT channel from the idle loop, and tracedecode.py turns them back into
+ * text using the format strings from the ELF.
+ *
+ * Format strings live in the .trace_fmt section, which isn't loaded into
+ * flash, and are identified by their offset in it.  Arguments must be
+ * integers (cast pointers and the like to uint32_t); %s can't be decoded.
+ */
+
+#define TRACE_MAX_ARGS      3
+#define TRACE_RING_SIZE     32    // records, power of 2
+#define TRACE_RTT_CHANNEL   1
+#define TRACE_RTT_BUF_SIZE  256
+
+// Format ID of the record reporting records lost to a full ring
+#define TRACE_FMT_DROPPED   0xFFFF
+
+typedef struct {
+  // Offset of the format string in .trace_fmt
+  uint16_t fmt_id;
+  uint8_t nargs;
+  // Set once the record is completely written
+  volatile uint8_t ready;
+  // RTC ticks when the record was written
+  uint32_t ticks;
+  uint32_t args[TRACE_MAX_ARGS];
+} trace_record_t;
+
+#define TRACE_FMT_ID(fmt) ({ \
+    static const char _trace_fmt[] \
+      __attribute__ ((section(".trace_fmt"), used)) = fmt; \
+    (uint16_t)(uint32_t)_trace_fmt; })
+
+#define TRACE_NARGS(...) _TRACE_NARGS(0, ##__VA_ARGS__, 3, 2, 1, 0)
+#define _TRACE_NARGS(_0, _1, _2, _3, n, ...) n
+
+#define TRACE(fmt, ...) \
+  trace_write(TRACE_FMT_ID(fmt), TRACE_NARGS(__VA_ARGS__), ##__VA_ARGS__)
+
+void trace_init(void);
+void trace_write(uint16_t fmt_id, uint8_t nargs, ...);
+void trace_flush(void);
+
+#endif /* _TRACE_H_ */
@@ -0,0 +1,85 @@
+"""
+Decode a binary trace capture (RTT channel 1) back into text.
+
+Usage: python tracedecode.py <firmware.out> <trace.bin>
+
+Format strings come from the .trace_fmt section of the ELF the badge is
+running; see trace.h for the record layout.
+"""
+
+import re
+import struct
+import sys
+
+RECORD = struct.Struct('<HBBI3I')
+FMT_DROPPED = 0xFFFF
+RTC_FREQ = 32768.0
+RTC_WRAP = 1 << 24
+
+
+def read_section(elf_path, name):
+    with open(elf_path, 'rb') as f:
+        elf = f.read()
+    if elf[:4] != b'\x7fELF' or elf[4] != 1:
+        raise ValueError('not a 32-bit ELF: %s' % elf_path)
+    shoff, = struct.unpack_from('<I', elf, 0x20)
+    shentsize, shnum, shstrndx = struct.unpack_from('<HHH', elf, 0x2E)
+
+    def section(i):
+        return struct.unpack_from('<IIIIII', elf, shoff + i * shentsize)
+
+    strtab = section(shstrndx)
+    for i in range(shnum):
+        sh_name, _, _, _, offset, size = section(i)
+        start = strtab[4] + sh_name
+        if elf[start:elf.index(b'\0', start)].decode() == name:
+            return elf[offset:offset + size]
+    raise ValueError('no %s section in %s' % (name, elf_path))
+
+
+def format_string(strings, fmt_id):
+    if fmt_id >= len(strings):
+        return None
+    return strings[fmt_id:strings.index(b'\0', fmt_id)].decode()
+
+
+def render(fmt, args):
+    # C length modifiers mean nothing here, and %s can't be recovered
+    fmt = re.sub(r'%([-+ #0-9.]*)(?:hh|h|ll|l|z)?([diuxXc])', r'%\1\2', fmt)
+    fmt = fmt.replace('%u', '%d').replace('%s', '<%x>')
+    try:
+        return fmt % tuple(args)
+    except (TypeError, ValueError):
+        return '%s %r' % (fmt, args)
+
+
+def decode(strings, data):
+    elapsed = 0
+    last_ticks = None
+    for off in range(0, len(data) - RECORD.size + 1, RECORD.size):
+        fmt_id, nargs, ready, ticks, a0, a1, a2 = RECORD.unpack_from(data, off)
+        if ready != 1 or nargs > 3:
+            print('Lost sync at byte %d' % off)
+            return
+        if last_ticks is not None:
+            elapsed += (ticks - last_ticks) % RTC_WRAP
+        last_ticks = ticks
+        args = [a0, a1, a2][:nargs]
+        if fmt_id == FMT_DROPPED:
+            text = '*** %d records dropped ***' % a0
+        else:
+            fmt = format_string(strings, fmt_id)
+            if fmt is None:
+                text = 'Unknown format %d %r' % (fmt_id, args)
+            else:
+                text = render(fmt, args)
+        print('%10.4f %s' % (elapsed / RTC_FREQ, text))
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        print('Usage: %s <firmware.out> <trace.bin>' % sys.argv[0])
+        sys.exit(1)
+    strings = read_section(sys.argv[1], '.trace_fmt')
+    with open(sys.argv[2], 'rb') as f:
+        decode(strings, f.read())
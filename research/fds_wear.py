@@ -0,0 +1,393 @@
+"""
+Flash wear model for the badge's FDS area.
+
+There's no host build of the firmware, so this models FDS (nRF5 SDK 15) at
+the word level: page tags, record headers, deletes, and GC copying live
+records into the swap page.  Traces of badge usage are replayed against it,
+and it reports how many bytes actually hit flash per byte the user changed,
+erases per page, and how long the flash should last.
+
+Sizes come from firmware/config/sdk_config.h and firmware/storage.[ch].  The
+peer manager records are estimates from the SDK structs.
+
+Usage: python3 fds_wear.py [trace ...]
+"""
+
+import random
+import sys
+
+
+# sdk_config.h
+FDS_VIRTUAL_PAGES = 3
+FDS_VIRTUAL_PAGE_SIZE = 1024        # words
+# fds_internal_defs.h
+PAGE_TAG_WORDS = 2
+RECORD_HEADER_WORDS = 3
+# nRF52810 product spec: guaranteed erase cycles per page
+FLASH_ENDURANCE = 10000
+
+# storage.c GC policy, storage_gc_poll()
+GC_DIRTY_RECORDS = 10
+GC_HEADROOM_LOW_WORDS = FDS_VIRTUAL_PAGE_SIZE // 4
+# main.c storage_busy()
+GC_IDLE_AFTER_MS = 1 * 60000
+
+# storage.h
+FILE_ID_METADATA = 1
+FILE_ID_MESSAGES = 2
+RECORD_ID_DEVICE_NAME = 1
+RECORD_ID_FIRSTBOOT = 2
+RECORD_ID_DISPLAY_STATE = 3
+RECORD_ID_MESSAGE_BASE = 1
+FILE_ID_PEER_MANAGER = 0xC000
+
+# led_display.h
+NUM_MESSAGES = 4
+MAX_BRIGHTNESS = 15
+DISPLAY_STATE_SAVE_DELAY_MS = 5000
+LED_MESSAGE_BYTES = 40              # sizeof(led_message), padded
+FIRSTBOOT_BYTES = 4
+DISPLAY_STATE_BYTES = 4             # sizeof(display_state_t)
+
+# Peer manager records per bond, in bytes (pm_peer_data_bonding_t, the local
+# GATT database cache and the service changed pending flag)
+PM_BOND_RECORDS = {1: 80, 2: 12, 3: 4}
+
+
+def words(nbytes):
+    return (nbytes + 3) // 4
+
+
+class Page(object):
+
+    def __init__(self, swap=False):
+        self.swap = swap
+        self.write_offset = PAGE_TAG_WORDS
+        # (file_id, key, words) of records written since the last erase,
+        # and whether each is still live
+        self.records = []
+        self.erases = 0
+
+    def free_words(self):
+        return FDS_VIRTUAL_PAGE_SIZE - self.write_offset
+
+    def dirty_records(self):
+        return sum(1 for r in self.records if not r[3])
+
+    def live_words(self):
+        return sum(r[2] for r in self.records if r[3])
+
+
+class FDS(object):
+    """Word-level stand-in for FDS."""
+
+    def __init__(self):
+        self.pages = [Page() for _ in range(FDS_VIRTUAL_PAGES - 1)]
+        self.pages.append(Page(swap=True))
+        self.words_written = 0
+        self.payload_bytes = 0
+        self.gc_runs = 0
+        self.gc_emergency = 0
+        self.gc_copied_words = 0
+        # Format: one tag per page
+        self.words_written += PAGE_TAG_WORDS * FDS_VIRTUAL_PAGES
+
+    def data_pages(self):
+        return [p for p in self.pages if not p.swap]
+
+    def find(self, file_id, key):
+        for page in self.data_pages():
+            for rec in page.records:
+                if rec[3] and rec[0] == file_id and rec[1] == key:
+                    return page, rec
+        return None, None
+
+    def stat(self):
+        pages = self.data_pages()
+        return {
+            'dirty_records': sum(p.dirty_records() for p in pages),
+            'largest_contig': max(p.free_words() for p in pages),
+            'freeable_words': sum(
+                p.write_offset - PAGE_TAG_WORDS - p.live_words()
+                for p in pages),
+        }
+
+    def _append(self, file_id, key, nbytes):
+        need = RECORD_HEADER_WORDS + words(nbytes)
+        for page in self.data_pages():
+            if page.free_words() >= need:
+                page.records.append([file_id, key, need, True])
+                page.write_offset += need
+                self.words_written += need
+                self.payload_bytes += nbytes
+                return True
+        return False
+
+    def _delete(self, page, rec):
+        # Deletion overwrites one header word
+        rec[3] = False
+        self.words_written += 1
+
+    def write(self, file_id, key, nbytes):
+        """fds_record_write() or fds_record_update(), as storage_save()."""
+        page, old = self.find(file_id, key)
+        if not self._append(file_id, key, nbytes):
+            self.gc(emergency=True)
+            if not self._append(file_id, key, nbytes):
+                raise RuntimeError('flash full')
+        if old is not None:
+            self._delete(page, old)
+
+    def delete(self, file_id, key):
+        page, rec = self.find(file_id, key)
+        if rec is not None:
+            self._delete(page, rec)
+
+    def delete_file(self, file_id):
+        for page in self.data_pages():
+            for rec in page.records:
+                if rec[3] and rec[0] == file_id:
+                    self._delete(page, rec)
+
+    def gc(self, emergency=False):
+        """fds_gc(): collect every data page holding a dirty record."""
+        self.gc_runs += 1
+        if emergency:
+            self.gc_emergency += 1
+        for page in self.data_pages():
+            if not page.dirty_records():
+                continue
+            swap = [p for p in self.pages if p.swap][0]
+            live = [r for r in page.records if r[3]]
+            for rec in live:
+                swap.records.append(list(rec))
+                swap.write_offset += rec[2]
+                self.words_written += rec[2]
+                self.gc_copied_words += rec[2]
+            # Swap tag is promoted to data by clearing a bit
+            swap.swap = False
+            self.words_written += 1
+            page.records = []
+            page.write_offset = PAGE_TAG_WORDS
+            page.erases += 1
+            page.swap = True
+            self.words_written += PAGE_TAG_WORDS
+
+    def idle(self, connected=False, untouched=True):
+        """One poll of the storage.c GC scheduler."""
+        st = self.stat()
+        if not st['freeable_words']:
+            return
+        if st['largest_contig'] < GC_HEADROOM_LOW_WORDS:
+            if not connected:
+                self.gc()
+        elif st['dirty_records'] > GC_DIRTY_RECORDS:
+            if not connected and untouched:
+                self.gc()
+
+
+class Badge(object):
+    """Maps badge-level actions onto the FDS calls the firmware makes."""
+
+    def __init__(self, fds):
+        self.fds = fds
+        self.logical_bytes = 0
+        self.next_peer = 0
+        self.peers = []
+        # (brightness, index) shown, as last saved, and when
+        # display_state_tmr fires if it's running
+        self.state = (MAX_BRIGHTNESS, 0)
+        self.saved_state = self.state
+        self.state_due = None
+
+    def firstboot(self):
+        self.fds.write(FILE_ID_METADATA, RECORD_ID_FIRSTBOOT, FIRSTBOOT_BYTES)
+        for i in range(NUM_MESSAGES):
+            self.save_message(i, 20)
+
+    def save_message(self, idx, text_len):
+        # App writes mode, speed, text and a NUL; the whole led_message is
+        # saved by display_save_storage()
+        self.logical_bytes += 3 + text_len + 1
+        self.fds.write(FILE_ID_MESSAGES, RECORD_ID_MESSAGE_BASE + idx,
+                       LED_MESSAGE_BYTES)
+
+    def save_name(self, name_len):
+        self.logical_bytes += name_len
+        self.fds.write(FILE_ID_METADATA, RECORD_ID_DEVICE_NAME, name_len + 1)
+
+    def set_state(self, now_ms, state, debounce):
+        """
+        display_state_changed() at now_ms.  Debounced, it restarts the save
+        timer; otherwise every change is saved straight away.
+        """
+        self.advance(now_ms)
+        self.state = state
+        if debounce:
+            self.state_due = now_ms + DISPLAY_STATE_SAVE_DELAY_MS
+        else:
+            self.save_state()
+
+    def advance(self, now_ms):
+        """Let display_state_tmr fire if it's due by now_ms."""
+        if self.state_due is not None and self.state_due <= now_ms:
+            self.state_due = None
+            self.save_state()
+
+    def save_state(self):
+        # display_state_write() skips a state that's already in flash
+        if self.state == self.saved_state:
+            return
+        self.fds.write(FILE_ID_METADATA, RECORD_ID_DISPLAY_STATE,
+                       DISPLAY_STATE_BYTES)
+        self.saved_state = self.state
+
+    def pair(self):
+        peer = self.next_peer
+        self.next_peer += 1
+        self.peers.append(peer)
+        for data_id, nbytes in sorted(PM_BOND_RECORDS.items()):
+            self.logical_bytes += nbytes
+            self.fds.write(FILE_ID_PEER_MANAGER + peer, data_id, nbytes)
+
+    def unpair_oldest(self):
+        if not self.peers:
+            return
+        peer = self.peers.pop(0)
+        self.fds.delete_file(FILE_ID_PEER_MANAGER + peer)
+
+    def repair(self):
+        """Phone forgot the badge and bonds again."""
+        self.unpair_oldest()
+        self.pair()
+
+    def idle(self, **kwargs):
+        self.fds.idle(**kwargs)
+
+
+def con_weekend(badge, rng, days=3):
+    """Three days of showing off: lots of edits, some re-pairing."""
+    for _ in range(days):
+        for _ in range(rng.randint(15, 40)):
+            # A connection: a few edits, then the phone goes away
+            for _ in range(rng.randint(1, 5)):
+                badge.save_message(rng.randrange(NUM_MESSAGES),
+                                   rng.randint(4, 35))
+                badge.idle(connected=True)
+            if rng.random() < 0.15:
+                badge.repair()
+            if rng.random() < 0.05:
+                badge.save_name(rng.randint(4, 20))
+            # Polls a while apart; the first is soon after the phone left
+            for i in range(rng.randint(1, 30)):
+                badge.idle(untouched=i > 0)
+
+
+def casual(badge, rng, days=3):
+    """Set it up once a day and leave it."""
+    for _ in range(days):
+        for _ in range(rng.randint(1, 3)):
+            badge.save_message(rng.randrange(NUM_MESSAGES),
+                               rng.randint(4, 35))
+        for i in range(10):
+            badge.idle(untouched=i > 0)
+
+
+def tinkerer(badge, rng, days=3):
+    """Somebody scripting the badge from a laptop."""
+    for _ in range(days):
+        for _ in range(500):
+            badge.save_message(rng.randrange(NUM_MESSAGES),
+                               rng.randint(4, 35))
+            badge.idle(connected=rng.random() < 0.8)
+        for _ in range(3):
+            badge.repair()
+            badge.save_name(rng.randint(4, 20))
+        for _ in range(10):
+            badge.idle()
+
+
+def display_state(badge, rng, days=3, debounce=True):
+    """
+    A con-weekend of joystick fiddling with brightness and messages.  Every
+    press is timestamped, and the save policy decides what reaches flash.
+    """
+    now = 0
+    for _ in range(days):
+        for _ in range(rng.randint(40, 80)):
+            start = badge.state
+            # A few goes, stepping brightness or flicking through messages
+            # a press at a time, with a look at the result in between
+            for _ in range(rng.randint(1, 4)):
+                brightness, index = badge.state
+                up = rng.random() < 0.5
+                flick = rng.random() < 0.4
+                for _ in range(rng.randint(1, 15)):
+                    now += rng.randint(150, 600)
+                    if flick:
+                        index = (index + (1 if up else -1)) % NUM_MESSAGES
+                    else:
+                        brightness = max(0, min(MAX_BRIGHTNESS,
+                                                brightness + (1 if up else -1)))
+                    badge.set_state(now, (brightness, index), debounce)
+                now += int(rng.expovariate(1 / 4000.0))
+            # Only a change that stuck counts as something the user meant
+            if badge.state != start:
+                badge.logical_bytes += DISPLAY_STATE_BYTES
+            # Then it's left alone for a while
+            pressed = now
+            for _ in range(rng.randint(1, 10)):
+                now += rng.randint(10000, 120000)
+                badge.advance(now)
+                badge.idle(untouched=now - pressed >= GC_IDLE_AFTER_MS)
+
+
+TRACES = {
+    'casual': casual,
+    'con-weekend': con_weekend,
+    'tinkerer': tinkerer,
+    'state-naive': lambda b, r, d: display_state(b, r, d, debounce=False),
+    'state-debounced': lambda b, r, d: display_state(b, r, d, debounce=True),
+}
+
+
+def run(name, days=3, seed=26):
+    fds = FDS()
+    badge = Badge(fds)
+    badge.firstboot()
+    badge.pair()
+    fds.gc()
+    # Don't count setup against the trace
+    base_words = fds.words_written
+    base_payload = fds.payload_bytes
+    base_erases = [p.erases for p in fds.pages]
+    base_gc = (fds.gc_runs, fds.gc_emergency, fds.gc_copied_words)
+    badge.logical_bytes = 0
+
+    TRACES[name](badge, random.Random(seed), days)
+
+    flash_bytes = (fds.words_written - base_words) * 4
+    payload = fds.payload_bytes - base_payload
+    erases = [p.erases - b for p, b in zip(fds.pages, base_erases)]
+    per_day = max(erases) / float(days)
+    print('%s (%d days):' % (name, days))
+    print('  logical bytes:      %d' % badge.logical_bytes)
+    print('  record payload:     %d' % payload)
+    print('  flash bytes:        %d' % flash_bytes)
+    print('  bytes per logical:  %.2f' % (
+        flash_bytes / float(max(badge.logical_bytes, 1))))
+    print('  bytes per payload:  %.2f' % (flash_bytes / float(max(payload, 1))))
+    print('  GC runs:            %d (%d emergency, %d words copied)' % (
+        fds.gc_runs - base_gc[0], fds.gc_emergency - base_gc[1],
+        fds.gc_copied_words - base_gc[2]))
+    print('  erases per page:    %s' % erases)
+    if per_day:
+        print('  lifetime:           %.0f days at this rate' % (
+            FLASH_ENDURANCE / per_day))
+    else:
+        print('  lifetime:           no erases')
+
+
+if __name__ == '__main__':
+    for name in sys.argv[1:] or sorted(TRACES):
+        run(name)
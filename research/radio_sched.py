@@ -0,0 +1,212 @@
+"""
+Radio-aware display scheduling model.
+
+The firmware holds a display frame back while the SoftDevice's radio
+notification says the radio is about to run, and draws it when the radio
+goes idle again (led_display.c, display_radio_defer()).  There's no host
+build and the notification cadence depends on what the phone asks for, so
+this stands in for the SoftDevice: it lays out advertising and connection
+events for a few badge situations, turns them into the active/inactive
+notifications the firmware would see, and runs the frame deadlines through
+the same policy.
+
+It reports how many frame transfers overlap a radio event with and without
+the deferral, how many frames were held back or forced out, and how long
+they waited.  Event lengths are estimates from the S112 spec and the SDK
+config, not measurements.
+
+Usage: python3 radio_sched.py [scenario ...]
+"""
+
+import bisect
+import random
+import sys
+
+
+# led_display.c: one frame per DISP_UPDATE_FREQUENCY_MS at speed 1
+FRAME_PERIOD_US = 50000
+# display_i2c_send(): address + 17 bytes, 9 clocks a byte, at 100 kHz (main.c)
+FRAME_TX_US = (1 + 17) * 9 * 10 + 80
+# led_display.h
+DISP_RADIO_MAX_DEFER_US = 12000
+# ble_manager.h RADIO_NOTIFICATION_DISTANCE
+NOTIFICATION_DISTANCE_US = 2680
+# From the inactive notification to display_render() running on LANE_LOW
+LANE_LATENCY_US = 60
+
+# ble_manager.h
+APP_ADV_FAST_INTERVAL_US = 0x28 * 625
+APP_ADV_BEACON_INTERVAL_US = 0x2000 * 625
+MIN_CONN_INTERVAL_US = 30000
+MAX_CONN_INTERVAL_US = 150000
+SLAVE_LATENCY = 5
+# sdk_config.h NRF_SDH_BLE_GAP_EVENT_LENGTH, in 1.25 ms units
+GAP_EVENT_LENGTH_US = 6 * 1250
+
+# Three channels of ADV_IND with a scan window after each
+ADV_EVENT_US = 1500
+# The beacon tier advertises on channel 37 only
+BEACON_EVENT_US = ADV_EVENT_US // 3
+# Spec advDelay, added to every advertising interval
+ADV_DELAY_MAX_US = 10000
+# An empty packet each way
+CONN_EVENT_EMPTY_US = 600
+
+
+def advertising(rng, duration, interval, length=ADV_EVENT_US):
+    events = []
+    t = rng.randrange(interval)
+    while t < duration:
+        events.append((t, t + length))
+        t += interval + rng.randrange(ADV_DELAY_MAX_US)
+    return events
+
+
+def connection(rng, duration, interval, every=1, busy=0.0,
+               busy_us=GAP_EVENT_LENGTH_US):
+    """
+    Connection events every interval, the badge listening at one in every
+    `every` (slave latency).  A `busy` fraction carry writes and run long.
+    """
+    events = []
+    t = rng.randrange(interval)
+    while t < duration:
+        if rng.random() < busy:
+            length = rng.randrange(CONN_EVENT_EMPTY_US, busy_us)
+        else:
+            length = CONN_EVENT_EMPTY_US
+        events.append((t, t + length))
+        t += interval * every
+    return events
+
+
+def pairing(rng, duration):
+    """Fast advertising while someone's trying to pair."""
+    return advertising(rng, duration, APP_ADV_FAST_INTERVAL_US)
+
+
+def editing(rng, duration):
+    """The app at the shortest interval, writing messages now and then."""
+    return connection(rng, duration, MIN_CONN_INTERVAL_US, busy=0.2)
+
+
+def idle_link(rng, duration):
+    """A phone left connected, using the slave latency, plus the beacon."""
+    return (connection(rng, duration, MAX_CONN_INTERVAL_US,
+                       every=SLAVE_LATENCY + 1) +
+            advertising(rng, duration, APP_ADV_BEACON_INTERVAL_US,
+                        BEACON_EVENT_US))
+
+
+def two_links(rng, duration):
+    """Two phones connected at once, both with the app open."""
+    return (connection(rng, duration, MIN_CONN_INTERVAL_US, busy=0.2) +
+            connection(rng, duration, 45000, busy=0.1))
+
+
+def throughput(rng, duration):
+    """
+    BLE_THROUGHPUT build streaming: connection event extension keeps the
+    radio going for most of every 7.5 ms interval.
+    """
+    return connection(rng, duration, 7500, busy=1.0, busy_us=7400)
+
+
+SCENARIOS = {
+    'pairing': pairing,
+    'editing': editing,
+    'idle_link': idle_link,
+    'two_links': two_links,
+    'throughput': throughput,
+}
+
+
+class RadioNotification(object):
+    """
+    Stands in for ble_radio_notification: active from
+    NOTIFICATION_DISTANCE_US before each radio event until it ends.  Events
+    closer together than that run into one window, as on the SoftDevice.
+    """
+
+    def __init__(self, events, distance=NOTIFICATION_DISTANCE_US):
+        self.starts = []
+        self.ends = []
+        for start, end in sorted(events):
+            start = max(start - distance, 0)
+            if self.ends and start <= self.ends[-1]:
+                self.ends[-1] = max(self.ends[-1], end)
+            else:
+                self.starts.append(start)
+                self.ends.append(end)
+
+    def window(self, t):
+        """The (start, end) of the active window at t, or None."""
+        i = bisect.bisect_right(self.starts, t) - 1
+        if i >= 0 and t < self.ends[i]:
+            return self.starts[i], self.ends[i]
+        return None
+
+
+class Radio(object):
+    """The radio events themselves, for checking transfers against."""
+
+    def __init__(self, events):
+        self.events = sorted(events)
+        self.starts = [s for s, _ in self.events]
+        self.longest = max([e - s for s, e in self.events] or [0])
+
+    def overlaps(self, start, end):
+        i = bisect.bisect_left(self.starts, start - self.longest)
+        while i < len(self.events) and self.events[i][0] < end:
+            if self.events[i][1] > start:
+                return True
+            i += 1
+        return False
+
+
+def schedule(notify, deadline, defer):
+    """
+    display_render() for a frame due at deadline.  Returns when the
+    transfer starts and whether it was deferred and forced.
+    """
+    if not defer:
+        return deadline, False, False
+    window = notify.window(deadline)
+    if window is None:
+        return deadline, False, False
+    idle = window[1] + LANE_LATENCY_US
+    if idle - deadline < DISP_RADIO_MAX_DEFER_US:
+        return idle, True, False
+    return deadline + DISP_RADIO_MAX_DEFER_US, True, True
+
+
+def run(name, seconds=600, seed=50):
+    duration = seconds * 1000000
+    events = SCENARIOS[name](random.Random(seed), duration)
+    radio = Radio(events)
+    notify = RadioNotification(events)
+    busy = sum(e - s for s, e in events) / float(duration)
+    print('%s (%d s, radio busy %.1f%%):' % (name, seconds, busy * 100))
+    for defer in (False, True):
+        frames = overlapped = deferred = forced = 0
+        waits = []
+        for deadline in range(0, duration, FRAME_PERIOD_US):
+            start, held, late = schedule(notify, deadline, defer)
+            frames += 1
+            if radio.overlaps(start, start + FRAME_TX_US):
+                overlapped += 1
+            if held:
+                deferred += 1
+                forced += late
+                waits.append(start - deadline)
+        print('  %-9s overlap %5.2f%%  deferred %5d  forced %5d  '
+              'wait mean %.2f max %.2f ms' % (
+                  'deferred' if defer else 'naive',
+                  overlapped * 100.0 / frames, deferred, forced,
+                  sum(waits) / 1000.0 / max(len(waits), 1),
+                  max(waits or [0]) / 1000.0))
+
+
+if __name__ == '__main__':
+    for name in sys.argv[1:] or sorted(SCENARIOS):
+        run(name)